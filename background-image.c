@@ -1,5 +1,15 @@
 #define _DEFAULT_SOURCE
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "background-image.h"
 #include "cairo.h"
 #include "log.h"
@@ -11,115 +21,240 @@
 #	include <endian.h>
 #endif
 
-// Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
-// xrgb32_le uses 32 bits per pixel, as XRGB, little endian (BGRX big endian).
-void cairo_rgb24_from_xrgb32_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			unsigned char *pix = buf + y * stride + x * 4;
-			*(uint32_t *)pix = 0 |
-				(uint32_t)pix[2] << 16 |
-				(uint32_t)pix[1] << 8 |
-				(uint32_t)pix[0];
-		}
+#ifdef USE_SSE
+#include <tmmintrin.h>
+// Only the kernels are built for SSSE3; callers check the CPU first
+#define SSSE3 __attribute__((target("ssse3")))
+#endif
+
+#if HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+#if HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+// The pixel layouts a screenshot can come in, as far as converting them to
+// cairo's RGB24 (XRGB, native endian) is concerned. The wl_shm formats with
+// alpha share a layout with their X counterparts; alpha is dropped.
+enum pixel_layout {
+	LAYOUT_XRGB8888,
+	LAYOUT_XBGR8888,
+	LAYOUT_XRGB2101010,
+	LAYOUT_XBGR2101010,
+	LAYOUT_RGBX1010102,
+	LAYOUT_BGRX1010102,
+	LAYOUT_BGR888,
+	LAYOUT_RGB888,
+};
+
+// Where the source pixel for destination pixel (x, y) lives:
+// origin + x * step_x + y * step_y. This folds the output transform into
+// the conversion, so that it doesn't need a separate pass.
+struct pixel_mapping {
+	const unsigned char *origin;
+	ptrdiff_t step_x, step_y;
+	enum pixel_layout layout;
+	int bpp;
+};
+
+static inline uint32_t convert_pixel(const unsigned char *pix,
+		enum pixel_layout layout) {
+	uint32_t color;
+	switch (layout) {
+	case LAYOUT_BGR888:
+		return (uint32_t)pix[0] << 16 | (uint32_t)pix[1] << 8 | pix[2];
+	case LAYOUT_RGB888:
+		return (uint32_t)pix[2] << 16 | (uint32_t)pix[1] << 8 | pix[0];
+	default:
+		break;
 	}
-}
 
-// Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
-// xbgr32_le uses 32 bits per pixel, as XBGR, little endian (RGBX big endian).
-void cairo_rgb24_from_xbgr32_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			unsigned char *pix = buf + y * stride + x * 4;
-			*(uint32_t *)pix = 0 |
-				(uint32_t)pix[0] << 16 |
-				(uint32_t)pix[1] << 8 |
-				(uint32_t)pix[2];
-		}
+	memcpy(&color, pix, sizeof(color));
+	color = le32toh(color);
+	switch (layout) {
+	case LAYOUT_XRGB8888:
+		return color & 0xFFFFFF;
+	case LAYOUT_XBGR8888:
+		return (color & 0xFF) << 16 | (color & 0xFF00) | ((color >> 16) & 0xFF);
+	case LAYOUT_XRGB2101010:
+		return ((color >> 22) & 0xFF) << 16 | ((color >> 12) & 0xFF) << 8 | ((color >> 2) & 0xFF);
+	case LAYOUT_XBGR2101010:
+		return ((color >> 2) & 0xFF) << 16 | ((color >> 12) & 0xFF) << 8 | ((color >> 22) & 0xFF);
+	case LAYOUT_RGBX1010102:
+		return ((color >> 24) & 0xFF) << 16 | ((color >> 14) & 0xFF) << 8 | ((color >> 4) & 0xFF);
+	case LAYOUT_BGRX1010102:
+		return ((color >> 4) & 0xFF) << 16 | ((color >> 14) & 0xFF) << 8 | ((color >> 24) & 0xFF);
+	default:
+		abort();
 	}
 }
 
-void cairo_rgb24_from_xrgb2101010_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			uint32_t *pix = (uint32_t *) (buf + y * stride + x * 4);
-			uint32_t color = le32toh(*pix);
-			*pix = 0 |
-				((color >> 22) & 0xFF) << 16 |
-				((color >> 12) & 0xFF) << 8 |
-				((color >> 2) & 0xFF);
-		}
+#if defined(USE_SSE) && BYTE_ORDER == LITTLE_ENDIAN
+#define HAVE_SIMD_CONVERT 1
+
+// Extracts three 8-bit channels from 32-bit pixels, given the bit offset of
+// each channel's top 8 bits, and packs them as XRGB.
+static inline SSSE3 __m128i convert4_shifts(__m128i v, int r, int g, int b) {
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	__m128i res = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, r), mask), 16);
+	res = _mm_or_si128(res, _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, g), mask), 8));
+	return _mm_or_si128(res, _mm_and_si128(_mm_srli_epi32(v, b), mask));
+}
+
+// Converts four 32-bit pixels.
+static inline SSSE3 __m128i convert4(__m128i v, enum pixel_layout layout) {
+	switch (layout) {
+	case LAYOUT_XRGB8888:
+		return _mm_and_si128(v, _mm_set1_epi32(0xFFFFFF));
+	case LAYOUT_XBGR8888:
+		return _mm_shuffle_epi8(v, _mm_setr_epi8(
+				2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1));
+	case LAYOUT_XRGB2101010:
+		return convert4_shifts(v, 22, 12, 2);
+	case LAYOUT_XBGR2101010:
+		return convert4_shifts(v, 2, 12, 22);
+	case LAYOUT_RGBX1010102:
+		return convert4_shifts(v, 24, 14, 4);
+	case LAYOUT_BGRX1010102:
+		return convert4_shifts(v, 4, 14, 24);
+	default:
+		abort();
 	}
 }
 
-void cairo_rgb24_from_xbgr2101010_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			uint32_t *pix = (uint32_t *) (buf + y * stride + x * 4);
-			uint32_t color = le32toh(*pix);
-			*pix = 0 |
-				((color >> 2) & 0xFF) << 16 |
-				((color >> 12) & 0xFF) << 8 |
-				((color >> 22) & 0xFF);
-		}
+// Converts four 24-bit pixels, from the first 12 bytes of 'v'.
+static inline SSSE3 __m128i convert4_888(__m128i v, enum pixel_layout layout) {
+	if (layout == LAYOUT_BGR888) {
+		return _mm_shuffle_epi8(v, _mm_setr_epi8(
+				2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+	} else {
+		return _mm_shuffle_epi8(v, _mm_setr_epi8(
+				0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
 	}
 }
 
-void cairo_rgb24_from_rgbx1010102_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			uint32_t *pix = (uint32_t *) (buf + y * stride + x * 4);
-			uint32_t color = le32toh(*pix);
-			*pix = 0 |
-				((color >> 24) & 0xFF) << 16 |
-				((color >> 14) & 0xFF) << 8 |
-				((color >> 4) & 0xFF);
+// Converts the start of a row, four pixels at a time, and returns
+// the first pixel left for convert_pixel.
+static SSSE3 int convert_row_simd(uint32_t *drow, const unsigned char *src,
+		int width, const struct pixel_mapping *map) {
+	int x = 0;
+	if (map->bpp == 4 && map->step_x == 4) {
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+			_mm_storeu_si128((__m128i *)(drow + x), convert4(v, map->layout));
+		}
+	} else if (map->bpp == 4 && map->step_x == -4) {
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src - (x + 3) * 4));
+			v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+			_mm_storeu_si128((__m128i *)(drow + x), convert4(v, map->layout));
+		}
+	} else if (map->bpp == 3 && map->step_x == 3) {
+		// Each load reads 16 bytes but only uses 12,
+		// so stop while there's still a pixel and a bit left in the row.
+		for (; x + 6 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + x * 3));
+			_mm_storeu_si128((__m128i *)(drow + x), convert4_888(v, map->layout));
 		}
 	}
+	return x;
 }
 
-void cairo_rgb24_from_bgrx1010102_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			uint32_t *pix = (uint32_t *) (buf + y * stride + x * 4);
-			uint32_t color = le32toh(*pix);
-			*pix = 0 |
-				((color >> 4) & 0xFF) << 16 |
-				((color >> 14) & 0xFF) << 8 |
-				((color >> 24) & 0xFF);
+// Converts whole 4x4 blocks of a tile. Each block is four runs of
+// contiguous source pixels, which are transposed into four destination
+// rows. Returns the first row left for the scalar loop.
+static SSSE3 int convert_tile_simd(uint32_t *dest, size_t dest_stride,
+		int x0, int y0, int x1, int y1, const struct pixel_mapping *map) {
+	int y = y0;
+	ptrdiff_t back = map->step_y < 0 ? 3 * 4 : 0;
+	for (; y + 4 <= y1; y += 4) {
+		int x = x0;
+		for (; x + 4 <= x1; x += 4) {
+			__m128i c[4];
+			for (int i = 0; i < 4; ++i) {
+				const unsigned char *src = map->origin +
+					(x + i) * map->step_x + y * map->step_y - back;
+				c[i] = _mm_loadu_si128((const __m128i *)src);
+				if (back) {
+					c[i] = _mm_shuffle_epi32(c[i], _MM_SHUFFLE(0, 1, 2, 3));
+				}
+			}
+
+			__m128i t0 = _mm_unpacklo_epi32(c[0], c[1]);
+			__m128i t1 = _mm_unpacklo_epi32(c[2], c[3]);
+			__m128i t2 = _mm_unpackhi_epi32(c[0], c[1]);
+			__m128i t3 = _mm_unpackhi_epi32(c[2], c[3]);
+			__m128i r[4] = {
+				_mm_unpacklo_epi64(t0, t1),
+				_mm_unpackhi_epi64(t0, t1),
+				_mm_unpacklo_epi64(t2, t3),
+				_mm_unpackhi_epi64(t2, t3),
+			};
+			for (int i = 0; i < 4; ++i) {
+				_mm_storeu_si128((__m128i *)(dest + (y + i) * dest_stride + x),
+						convert4(r[i], map->layout));
+			}
+		}
+
+		for (; x < x1; ++x) {
+			for (int i = 0; i < 4; ++i) {
+				dest[(y + i) * dest_stride + x] = convert_pixel(map->origin +
+						x * map->step_x + (y + i) * map->step_y, map->layout);
+			}
 		}
 	}
+	return y;
 }
+#else
+#define HAVE_SIMD_CONVERT 0
+#endif
 
-// Cairo RGB24 uses 32 bits per pixel, as XRGB, in native endianness.
-// BGR888 uses 24 bits per pixel, as BGR, little endian.
-// 24-bit BGR format, [23:0] B:G:R little endian (From wayland-client-protocol.h)
-void cairo_rgb24_from_bgr888_le(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		// Row from back to front to avoid overwriting data.
-		for (int x = width-1; x >= 0; --x) {
-			// 24 bits = 3 bytes, 32 bits = 4 bytes
-			unsigned char *srcpix = buf + y * stride + x * 3;
-			unsigned char *dstpix = buf + y * stride + x * 4;
-
-			*(uint32_t *)dstpix = 0 |
-				(uint32_t)srcpix[0] << 16 |
-				(uint32_t)srcpix[1] << 8 |
-				(uint32_t)srcpix[2];
+// Converts rows [y0, y1) for transforms which keep rows as rows,
+// so that each destination row reads one source row.
+static void convert_rows(uint32_t *dest, size_t dest_stride, int width,
+		int y0, int y1, const struct pixel_mapping *map) {
+	for (int y = y0; y < y1; ++y) {
+		const unsigned char *src = map->origin + y * map->step_y;
+		uint32_t *drow = dest + y * dest_stride;
+		int x = 0;
+
+#if HAVE_SIMD_CONVERT
+		if (__builtin_cpu_supports("ssse3")) {
+			x = convert_row_simd(drow, src, width, map);
+		}
+#endif
+
+		for (; x < width; ++x) {
+			drow[x] = convert_pixel(src + x * map->step_x, map->layout);
 		}
 	}
 }
 
-// Swap red and blue values in Cairo RGB24
-void cairo_rgb24_swap_rb(unsigned char *buf, int width, int height, int stride) {
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			unsigned char *pix = buf + y * stride + x * 4;
+#define CONVERT_TILE 64
+
+// Converts one tile for transforms which turn source columns into
+// destination rows. Working tile by tile keeps the source rows being
+// read from in cache, instead of walking down a whole column per pixel.
+static void convert_tile(uint32_t *dest, size_t dest_stride,
+		int x0, int y0, int x1, int y1, const struct pixel_mapping *map) {
+	int y = y0;
+
+#if HAVE_SIMD_CONVERT
+	if (map->bpp == 4 && __builtin_cpu_supports("ssse3")) {
+		y = convert_tile_simd(dest, dest_stride, x0, y0, x1, y1, map);
+	}
+#endif
 
-			*(uint32_t *)pix = 0 |
-				(uint32_t)pix[0] << 16 |
-				(uint32_t)pix[1] << 8 |
-				(uint32_t)pix[2];
+	for (; y < y1; ++y) {
+		const unsigned char *src = map->origin + y * map->step_y;
+		uint32_t *drow = dest + y * dest_stride;
+		for (int x = x0; x < x1; ++x) {
+			drow[x] = convert_pixel(src + x * map->step_x, map->layout);
 		}
 	}
 }
@@ -156,162 +291,42 @@ cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
 	} else {
 		image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
 	}
-	if (image == NULL) {
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
 		swaylock_log(LOG_ERROR, "Failed to create image..");
+		cairo_surface_destroy(image);
 		return NULL;
 	}
 
-	unsigned char *destbuf = cairo_image_surface_get_data(image);
-	size_t destwidth = cairo_image_surface_get_width(image);
-	size_t destheight = cairo_image_surface_get_height(image);
-	size_t deststride = cairo_image_surface_get_stride(image);
-	unsigned char *srcbuf = buf;
-	size_t srcstride = stride;
-	size_t minstride = srcstride < deststride ? srcstride : deststride;
-
-	// Lots of these are mostly-copy-and-pasted, with a lot of boilerplate
-	// for each case.
-	// The only interesting differencess between a lot of these cases are
-	// the definitions of srcx and srcy.
-	// I don't think it's worth adding a macro to make this "cleaner" though,
-	// as that would obfuscate what's actually going on.
-	switch (transform) {
-	case WL_OUTPUT_TRANSFORM_NORMAL:
-		// In most cases, the transform is probably normal. Luckily, it can be
-		// done with just one big memcpy.
-		if (srcstride == deststride) {
-			memcpy(destbuf, srcbuf, destheight * deststride);
-		} else {
-			for (size_t y = 0; y < destheight; ++y) {
-				memcpy(destbuf + y * deststride, srcbuf + y * srcstride, minstride);
-			}
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_90:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = desty;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_180:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcy = destheight - desty - 1;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcx = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_270:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = destheight - desty - 1;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destx;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_FLIPPED:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcy = desty;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcx = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = desty;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destx;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcy = destheight - desty - 1;
-			memcpy(destbuf + desty * deststride, srcbuf + srcy * srcstride, minstride);
-		}
-		break;
-	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		for (size_t desty = 0; desty < destheight; ++desty) {
-			size_t srcx = destheight - desty - 1;
-			for (size_t destx = 0; destx < destwidth; ++destx) {
-				size_t srcy = destwidth - destx - 1;
-				*((uint32_t *)(destbuf + desty * deststride) + destx) =
-					*((uint32_t *)(srcbuf + srcy * srcstride) + srcx);
-			}
-		}
-		break;
-	}
-
+	struct pixel_mapping map;
+	map.bpp = 4;
 	switch (format) {
 	case WL_SHM_FORMAT_XBGR8888:
 	case WL_SHM_FORMAT_ABGR8888:
-		cairo_rgb24_from_xbgr32_le(
-				cairo_image_surface_get_data(image),
-				cairo_image_surface_get_width(image),
-				cairo_image_surface_get_height(image),
-				cairo_image_surface_get_stride(image));
+		map.layout = LAYOUT_XBGR8888;
 		break;
 	case WL_SHM_FORMAT_XRGB2101010:
 	case WL_SHM_FORMAT_ARGB2101010:
-		cairo_rgb24_from_xrgb2101010_le(
-				cairo_image_surface_get_data(image),
-				cairo_image_surface_get_width(image),
-				cairo_image_surface_get_height(image),
-				cairo_image_surface_get_stride(image));
+		map.layout = LAYOUT_XRGB2101010;
 		break;
 	case WL_SHM_FORMAT_XBGR2101010:
 	case WL_SHM_FORMAT_ABGR2101010:
-		cairo_rgb24_from_xbgr2101010_le(
-				cairo_image_surface_get_data(image),
-				cairo_image_surface_get_width(image),
-				cairo_image_surface_get_height(image),
-				cairo_image_surface_get_stride(image));
+		map.layout = LAYOUT_XBGR2101010;
 		break;
 	case WL_SHM_FORMAT_RGBX1010102:
 	case WL_SHM_FORMAT_RGBA1010102:
-		cairo_rgb24_from_rgbx1010102_le(
-				cairo_image_surface_get_data(image),
-				cairo_image_surface_get_width(image),
-				cairo_image_surface_get_height(image),
-				cairo_image_surface_get_stride(image));
+		map.layout = LAYOUT_RGBX1010102;
 		break;
 	case WL_SHM_FORMAT_BGRX1010102:
 	case WL_SHM_FORMAT_BGRA1010102:
-		cairo_rgb24_from_bgrx1010102_le(
-				cairo_image_surface_get_data(image),
-				cairo_image_surface_get_width(image),
-				cairo_image_surface_get_height(image),
-				cairo_image_surface_get_stride(image));
+		map.layout = LAYOUT_BGRX1010102;
 		break;
 	case WL_SHM_FORMAT_BGR888:
+		map.layout = LAYOUT_BGR888;
+		map.bpp = 3;
+		break;
 	case WL_SHM_FORMAT_RGB888:
-			cairo_rgb24_from_bgr888_le(
-					cairo_image_surface_get_data(image),
-					cairo_image_surface_get_width(image),
-					cairo_image_surface_get_height(image),
-					cairo_image_surface_get_stride(image)
-					);
-			if (format == WL_SHM_FORMAT_RGB888) {
-				cairo_rgb24_swap_rb(
-						cairo_image_surface_get_data(image),
-						cairo_image_surface_get_width(image),
-						cairo_image_surface_get_height(image),
-						cairo_image_surface_get_stride(image)
-						);
-			}
+		map.layout = LAYOUT_RGB888;
+		map.bpp = 3;
 		break;
 	default:
 		swaylock_log(LOG_ERROR,
@@ -319,25 +334,550 @@ cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
 				format);
 		// fallthrough
 	case WL_SHM_FORMAT_XRGB8888:
-	case WL_SHM_FORMAT_ARGB8888: {
-		// If we're little endian, we don't have to do anything
-		int test = 1;
-		bool is_little_endian = *(char *)&test == 1;
-		if (!is_little_endian) {
-			cairo_rgb24_from_xrgb32_le(
-					cairo_image_surface_get_data(image),
-					cairo_image_surface_get_width(image),
-					cairo_image_surface_get_height(image),
-					cairo_image_surface_get_stride(image));
+	case WL_SHM_FORMAT_ARGB8888:
+		map.layout = LAYOUT_XRGB8888;
+		break;
+	}
+
+	uint32_t *destbuf = (uint32_t *)cairo_image_surface_get_data(image);
+	int destwidth = cairo_image_surface_get_width(image);
+	int destheight = cairo_image_surface_get_height(image);
+	size_t deststride = cairo_image_surface_get_stride(image) / sizeof(uint32_t);
+	const unsigned char *srcbuf = buf;
+	ptrdiff_t bpp = map.bpp;
+	ptrdiff_t srcstride = stride;
+
+	// For each transform, this is the inverse of what the transform does:
+	// where in the source buffer the pixels of the destination come from.
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		map.origin = srcbuf;
+		map.step_x = bpp;
+		map.step_y = srcstride;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		map.origin = srcbuf + (destwidth - 1) * srcstride;
+		map.step_x = -srcstride;
+		map.step_y = bpp;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		map.origin = srcbuf + (destheight - 1) * srcstride + (destwidth - 1) * bpp;
+		map.step_x = -bpp;
+		map.step_y = -srcstride;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		map.origin = srcbuf + (destheight - 1) * bpp;
+		map.step_x = srcstride;
+		map.step_y = -bpp;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		map.origin = srcbuf + (destwidth - 1) * bpp;
+		map.step_x = -bpp;
+		map.step_y = srcstride;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		map.origin = srcbuf;
+		map.step_x = srcstride;
+		map.step_y = bpp;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		map.origin = srcbuf + (destheight - 1) * srcstride;
+		map.step_x = bpp;
+		map.step_y = -srcstride;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		map.origin = srcbuf + (destwidth - 1) * srcstride + (destheight - 1) * bpp;
+		map.step_x = -srcstride;
+		map.step_y = -bpp;
+		break;
+	default:
+		abort();
+	}
+
+	if (rotated) {
+		int tiles_x = (destwidth + CONVERT_TILE - 1) / CONVERT_TILE;
+		int tiles_y = (destheight + CONVERT_TILE - 1) / CONVERT_TILE;
+#pragma omp parallel for
+		for (int ty = 0; ty < tiles_y; ++ty) {
+			int y0 = ty * CONVERT_TILE;
+			int y1 = MIN(y0 + CONVERT_TILE, destheight);
+			for (int tx = 0; tx < tiles_x; ++tx) {
+				int x0 = tx * CONVERT_TILE;
+				int x1 = MIN(x0 + CONVERT_TILE, destwidth);
+				convert_tile(destbuf, deststride, x0, y0, x1, y1, &map);
+			}
+		}
+	} else {
+#pragma omp parallel for
+		for (int y = 0; y < destheight; ++y) {
+			convert_rows(destbuf, deststride, destwidth, y, y + 1, &map);
 		}
 	}
+
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+
+// A raw image is a header, padded to RAW_IMAGE_HEADER_SIZE, and an optional
+// tag, padded to a multiple of it, followed by the rows of a cairo image
+// surface: RGB24 or premultiplied ARGB32 pixels in the writer's byte order.
+// It can be mapped and used without any decoding.
+#define RAW_IMAGE_MAGIC "swaylock-raw"
+#define RAW_IMAGE_BYTE_ORDER 0x01020304
+#define RAW_IMAGE_HEADER_SIZE 64
+#define RAW_IMAGE_TAG_MAX (64 * 1024)
+
+struct raw_image_header {
+	char magic[sizeof(RAW_IMAGE_MAGIC)];
+	// RAW_IMAGE_BYTE_ORDER, to reject files from hosts of the other byte order
+	uint32_t byte_order;
+	uint32_t format; // cairo_format_t
+	uint32_t width, height, stride;
+	uint32_t tag_size;
+};
+static_assert(sizeof(struct raw_image_header) <= RAW_IMAGE_HEADER_SIZE,
+		"raw image header too large");
+
+struct raw_image_mapping {
+	void *data;
+	size_t size;
+};
+
+static const cairo_user_data_key_t raw_image_mapping_key;
+
+static void raw_image_mapping_destroy(void *data) {
+	struct raw_image_mapping *mapping = data;
+	munmap(mapping->data, mapping->size);
+	free(mapping);
+}
+
+static size_t raw_image_tag_padded(uint32_t tag_size) {
+	return ((size_t)tag_size + RAW_IMAGE_HEADER_SIZE - 1) /
+		RAW_IMAGE_HEADER_SIZE * RAW_IMAGE_HEADER_SIZE;
+}
+
+// Whether the tag stored at the start of the file is exactly 'tag'
+static bool raw_image_tag_matches(int fd, const struct raw_image_header *header,
+		const char *tag) {
+	size_t len = strlen(tag);
+	if (header->tag_size != len) {
+		return false;
+	}
+	char *stored = malloc(len + 1);
+	if (stored == NULL) {
+		return false;
 	}
+	bool match = pread(fd, stored, len, RAW_IMAGE_HEADER_SIZE) == (ssize_t)len &&
+		memcmp(stored, tag, len) == 0;
+	free(stored);
+	return match;
+}
 
+cairo_surface_t *load_raw_image(const char *path, const char *tag) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct raw_image_header header;
+	struct stat st;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+			memcmp(header.magic, RAW_IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+			fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t offset = RAW_IMAGE_HEADER_SIZE + raw_image_tag_padded(header.tag_size);
+	size_t size = offset + (size_t)header.stride * header.height;
+	if (header.byte_order != RAW_IMAGE_BYTE_ORDER ||
+			header.tag_size > RAW_IMAGE_TAG_MAX ||
+			(header.format != CAIRO_FORMAT_RGB24 &&
+			 header.format != CAIRO_FORMAT_ARGB32) ||
+			header.width == 0 || header.width > INT16_MAX ||
+			header.height == 0 || header.height > INT16_MAX ||
+			// The effects assume rows without padding, which is all
+			// write_raw_image ever writes
+			(int)header.stride !=
+				cairo_format_stride_for_width(header.format, header.width) ||
+			(size_t)st.st_size < size) {
+		swaylock_log(LOG_ERROR, "Invalid raw image %s.", path);
+		close(fd);
+		return NULL;
+	}
+
+	if (tag != NULL && !raw_image_tag_matches(fd, &header, tag)) {
+		swaylock_log(LOG_DEBUG, "Raw image %s has a different tag", path);
+		close(fd);
+		return NULL;
+	}
+
+	// Private, so the effects can run on the pages in place
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to map raw image %s", path);
+		return NULL;
+	}
+
+	struct raw_image_mapping *mapping = malloc(sizeof(*mapping));
+	if (mapping == NULL) {
+		munmap(data, size);
+		return NULL;
+	}
+	mapping->data = data;
+	mapping->size = size;
+
+	cairo_surface_t *image = cairo_image_surface_create_for_data(
+			(unsigned char *)data + offset, header.format,
+			header.width, header.height, header.stride);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS ||
+			cairo_surface_set_user_data(image, &raw_image_mapping_key,
+				mapping, raw_image_mapping_destroy) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(image);
+		raw_image_mapping_destroy(mapping);
+		return NULL;
+	}
+
+	swaylock_log(LOG_DEBUG, "Mapped raw image %s, %ux%u", path,
+			header.width, header.height);
 	return image;
 }
 
-cairo_surface_t *load_background_image(const char *path) {
-	cairo_surface_t *image;
+bool write_raw_image(cairo_surface_t *image, const char *tag,
+		const char *path) {
+	if (tag == NULL) {
+		tag = "";
+	}
+	size_t tag_size = strlen(tag);
+	if (tag_size > RAW_IMAGE_TAG_MAX) {
+		swaylock_log(LOG_ERROR, "Tag for raw image %s is too long", path);
+		return false;
+	}
+
+	cairo_surface_flush(image);
+	unsigned char padded[RAW_IMAGE_HEADER_SIZE] = {0};
+	struct raw_image_header header = {
+		.magic = RAW_IMAGE_MAGIC,
+		.byte_order = RAW_IMAGE_BYTE_ORDER,
+		.format = cairo_image_surface_get_format(image),
+		.width = cairo_image_surface_get_width(image),
+		.height = cairo_image_surface_get_height(image),
+		.stride = cairo_image_surface_get_stride(image),
+		.tag_size = tag_size,
+	};
+	memcpy(padded, &header, sizeof(header));
+	size_t tag_padding = raw_image_tag_padded(tag_size) - tag_size;
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		swaylock_log_errno(LOG_ERROR, "Failed to open %s", path);
+		return false;
+	}
+
+	unsigned char *data = cairo_image_surface_get_data(image);
+	size_t size = (size_t)header.stride * header.height;
+	static const unsigned char zeros[RAW_IMAGE_HEADER_SIZE] = {0};
+	bool ok = fwrite(padded, 1, sizeof(padded), file) == sizeof(padded) &&
+		fwrite(tag, 1, tag_size, file) == tag_size &&
+		fwrite(zeros, 1, tag_padding, file) == tag_padding &&
+		fwrite(data, 1, size, file) == size;
+	if (fclose(file) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		swaylock_log_errno(LOG_ERROR, "Failed to write %s", path);
+	}
+	return ok;
+}
+
+// The factor an image is scaled by when it's rendered into a buffer of the
+// given size. A buffer size of 0 means the size isn't known.
+static double render_scale(int image_width, int image_height,
+		int width, int height, enum background_mode mode) {
+	if (width <= 0 || height <= 0) {
+		return 1;
+	}
+
+	double scale_x = (double)width / image_width;
+	double scale_y = (double)height / image_height;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+	case BACKGROUND_MODE_FILL:
+		return scale_x > scale_y ? scale_x : scale_y;
+	case BACKGROUND_MODE_FIT:
+		return scale_x < scale_y ? scale_x : scale_y;
+	default:
+		// Centered and tiled images are shown at their own size
+		return 1;
+	}
+}
+
+#if HAVE_LIBJPEG || HAVE_LIBPNG
+// The largest of 1, 2, 4 and 8 an image can be shrunk by while decoding,
+// without ending up smaller than it's rendered at.
+static int decode_denominator(int image_width, int image_height,
+		int width, int height, enum background_mode mode) {
+	double scale = render_scale(image_width, image_height, width, height, mode);
+	int denom = 1;
+	while (denom < 8 && scale * denom * 2 <= 1) {
+		denom *= 2;
+	}
+	return denom;
+}
+#endif // HAVE_LIBJPEG || HAVE_LIBPNG
+
+#if HAVE_LIBJPEG
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf env;
+};
+
+static void handle_jpeg_error(j_common_ptr cinfo) {
+	struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, msg);
+	swaylock_log(LOG_DEBUG, "libjpeg: %s", msg);
+	longjmp(err->env, 1);
+}
+
+// Decodes a JPEG, letting libjpeg scale it down in the DCT domain, which is
+// much cheaper than decoding it whole. Returns NULL if libjpeg can't read
+// the file (e.g. CMYK images), so the generic loader gets a go at it.
+static cairo_surface_t *load_jpeg(FILE *file, int width, int height,
+		enum background_mode mode) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error err;
+	cairo_surface_t *volatile image = NULL;
+	JSAMPLE *volatile row = NULL;
+
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = handle_jpeg_error;
+	if (setjmp(err.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		if (image) {
+			cairo_surface_destroy(image);
+		}
+		free(row);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = decode_denominator(cinfo.image_width,
+			cinfo.image_height, width, height, mode);
+#ifdef JCS_EXTENSIONS
+	// libjpeg-turbo can write cairo's pixel layout directly
+#if BYTE_ORDER == LITTLE_ENDIAN
+	cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+	cinfo.out_color_space = JCS_EXT_XRGB;
+#endif
+#else
+	cinfo.out_color_space = JCS_RGB;
+#endif
+	jpeg_start_decompress(&cinfo);
+
+	image = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+			cinfo.output_width, cinfo.output_height);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		longjmp(err.env, 1);
+	}
+	cairo_surface_flush(image);
+	unsigned char *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+#ifndef JCS_EXTENSIONS
+	row = malloc(cinfo.output_width * 3);
+	if (!row) {
+		longjmp(err.env, 1);
+	}
+#endif
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		unsigned char *dst = data + (size_t)cinfo.output_scanline * stride;
+#ifdef JCS_EXTENSIONS
+		JSAMPROW rows[1] = { dst };
+		jpeg_read_scanlines(&cinfo, rows, 1);
+#else
+		JSAMPROW rows[1] = { row };
+		jpeg_read_scanlines(&cinfo, rows, 1);
+		uint32_t *pixels = (uint32_t *)dst;
+		for (JDIMENSION x = 0; x < cinfo.output_width; ++x) {
+			pixels[x] = 0xFF000000 | (uint32_t)row[3 * x] << 16 |
+				(uint32_t)row[3 * x + 1] << 8 | row[3 * x + 2];
+		}
+#endif
+	}
+
+	swaylock_log(LOG_DEBUG, "Decoded JPEG at 1/%u scale, %ux%u",
+			cinfo.scale_denom, cinfo.output_width, cinfo.output_height);
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(row);
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+#endif // HAVE_LIBJPEG
+
+#if HAVE_LIBPNG
+static void handle_png_error(png_structp png, png_const_charp msg) {
+	swaylock_log(LOG_DEBUG, "libpng: %s", msg);
+	png_longjmp(png, 1);
+}
+
+static void handle_png_warning(png_structp png, png_const_charp msg) {
+	swaylock_log(LOG_DEBUG, "libpng: %s", msg);
+}
+
+// Decodes a PNG, averaging each block of denom x denom pixels as the rows
+// come in. PNG can't skip any of the decoding work, but the full size image
+// is never in memory and cairo has less to scale. Returns NULL if libpng
+// can't read the file this way, so the generic loader gets a go at it.
+static cairo_surface_t *load_png(FILE *file, int width, int height,
+		enum background_mode mode) {
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+			handle_png_error, handle_png_warning);
+	if (!png) {
+		return NULL;
+	}
+	png_infop info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return NULL;
+	}
+
+	cairo_surface_t *volatile image = NULL;
+	png_bytep volatile row = NULL;
+	uint32_t *volatile sums = NULL;
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		if (image) {
+			cairo_surface_destroy(image);
+		}
+		free(row);
+		free(sums);
+		return NULL;
+	}
+
+	png_init_io(png, file);
+	png_read_info(png, info);
+	if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+		// Interlaced images can't be read a row at a time
+		png_destroy_read_struct(&png, &info, NULL);
+		return NULL;
+	}
+
+	int image_width = png_get_image_width(png, info);
+	int image_height = png_get_image_height(png, info);
+	bool alpha = (png_get_color_type(png, info) & PNG_COLOR_MASK_ALPHA) ||
+		png_get_valid(png, info, PNG_INFO_tRNS);
+	// Have libpng hand us 8-bit RGBA, whatever the file has
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+	png_read_update_info(png, info);
+
+	int denom = decode_denominator(image_width, image_height,
+			width, height, mode);
+	int out_width = (image_width + denom - 1) / denom;
+	int out_height = (image_height + denom - 1) / denom;
+	image = cairo_image_surface_create(
+			alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+			out_width, out_height);
+	row = malloc((size_t)image_width * 4);
+	// Premultiplied R, G, B and A of the block row being read
+	sums = calloc((size_t)out_width * 4, sizeof(uint32_t));
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS ||
+			!row || !sums) {
+		png_longjmp(png, 1);
+	}
+	cairo_surface_flush(image);
+	unsigned char *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+
+	for (int y = 0; y < image_height; ++y) {
+		png_read_row(png, row, NULL);
+		for (int x = 0; x < image_width; ++x) {
+			uint32_t *sum = &sums[(x / denom) * 4];
+			uint32_t a = row[4 * x + 3];
+			sum[0] += row[4 * x] * a;
+			sum[1] += row[4 * x + 1] * a;
+			sum[2] += row[4 * x + 2] * a;
+			sum[3] += a;
+		}
+
+		if ((y + 1) % denom != 0 && y + 1 != image_height) {
+			continue;
+		}
+
+		int rows = y % denom + 1;
+		uint32_t *pixels = (uint32_t *)(data + (size_t)(y / denom) * stride);
+		for (int x = 0; x < out_width; ++x) {
+			uint32_t *sum = &sums[x * 4];
+			uint32_t n = rows * MIN(denom, image_width - x * denom);
+			uint32_t r = (sum[0] + n * 255 / 2) / (n * 255);
+			uint32_t g = (sum[1] + n * 255 / 2) / (n * 255);
+			uint32_t b = (sum[2] + n * 255 / 2) / (n * 255);
+			uint32_t a = (sum[3] + n / 2) / n;
+			pixels[x] = a << 24 | r << 16 | g << 8 | b;
+		}
+		memset(sums, 0, (size_t)out_width * 4 * sizeof(uint32_t));
+	}
+
+	png_read_end(png, NULL);
+	png_destroy_read_struct(&png, &info, NULL);
+	free(row);
+	free(sums);
+	cairo_surface_mark_dirty(image);
+	swaylock_log(LOG_DEBUG, "Decoded PNG at 1/%d scale, %dx%d",
+			denom, out_width, out_height);
+	return image;
+}
+#endif // HAVE_LIBPNG
+
+// Tries the decoders which can shrink the image while decoding it.
+static cairo_surface_t *load_scaled_image(const char *path,
+		int width, int height, enum background_mode mode) {
+	cairo_surface_t *image = NULL;
+#if HAVE_LIBJPEG || HAVE_LIBPNG
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return NULL;
+	}
+
+	unsigned char magic[8];
+	size_t len = fread(magic, 1, sizeof(magic), file);
+	rewind(file);
+#if HAVE_LIBJPEG
+	if (len >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) {
+		image = load_jpeg(file, width, height, mode);
+	}
+#endif
+#if HAVE_LIBPNG
+	if (len >= 8 && png_sig_cmp(magic, 0, 8) == 0) {
+		image = load_png(file, width, height, mode);
+	}
+#endif
+	fclose(file);
+#endif // HAVE_LIBJPEG || HAVE_LIBPNG
+	return image;
+}
+
+cairo_surface_t *load_background_image(const char *path,
+		int width, int height, enum background_mode mode) {
+	cairo_surface_t *image = load_raw_image(path, NULL);
+	if (image) {
+		return image;
+	}
+
+	image = load_scaled_image(path, width, height, mode);
+	if (image) {
+		return image;
+	}
+
 #if HAVE_GDK_PIXBUF
 	GError *err = NULL;
 	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &err);
@@ -357,9 +897,12 @@ cairo_surface_t *load_background_image(const char *path) {
 	}
 	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
 		swaylock_log(LOG_ERROR, "Failed to read background image: %s."
-#if !HAVE_GDK_PIXBUF
+#if !HAVE_GDK_PIXBUF && !HAVE_LIBJPEG
 				"\nSway was compiled without gdk_pixbuf support, so only"
 				"\nPNG images can be loaded. This is the likely cause."
+#elif !HAVE_GDK_PIXBUF
+				"\nSway was compiled without gdk_pixbuf support, so only"
+				"\nPNG and JPEG images can be loaded. This is the likely cause."
 #endif // !HAVE_GDK_PIXBUF
 				, cairo_status_to_string(cairo_surface_status(image)));
 		return NULL;
@@ -367,6 +910,281 @@ cairo_surface_t *load_background_image(const char *path) {
 	return image;
 }
 
+// Halves an image in both directions, averaging each 2x2 block of
+// (premultiplied) pixels. An odd last row or column is dropped.
+static cairo_surface_t *halve_image(cairo_surface_t *image) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int stride = cairo_image_surface_get_stride(image);
+	cairo_surface_t *half = cairo_image_surface_create(
+			cairo_image_surface_get_format(image), width / 2, height / 2);
+	if (cairo_surface_status(half) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(half);
+		return NULL;
+	}
+
+	cairo_surface_flush(image);
+	cairo_surface_flush(half);
+	unsigned char *src = cairo_image_surface_get_data(image);
+	unsigned char *dst = cairo_image_surface_get_data(half);
+	int half_stride = cairo_image_surface_get_stride(half);
+
+#pragma omp parallel for
+	for (int y = 0; y < height / 2; ++y) {
+		uint32_t *row0 = (uint32_t *)(src + (size_t)(2 * y) * stride);
+		uint32_t *row1 = (uint32_t *)(src + (size_t)(2 * y + 1) * stride);
+		uint32_t *out = (uint32_t *)(dst + (size_t)y * half_stride);
+		for (int x = 0; x < width / 2; ++x) {
+			uint32_t p[4] = {
+				row0[2 * x], row0[2 * x + 1], row1[2 * x], row1[2 * x + 1],
+			};
+			// Sum two channels at once per 32-bit word, with room to spare
+			uint32_t rb = 0x00020002, ag = 0x00020002;
+			for (int i = 0; i < 4; ++i) {
+				rb += p[i] & 0x00FF00FF;
+				ag += (p[i] >> 8) & 0x00FF00FF;
+			}
+			out[x] = ((rb >> 2) & 0x00FF00FF) | (((ag >> 2) & 0x00FF00FF) << 8);
+		}
+	}
+
+	cairo_surface_mark_dirty(half);
+	return half;
+}
+
+// Finds the part of a buffer that an image is drawn to. Only center and fit
+// leave some of the buffer to the background colour. The region is aligned
+// to multiples of align.
+static void background_image_region(cairo_surface_t *image,
+		enum background_mode mode, int buffer_width, int buffer_height,
+		int align, int *x, int *y, int *width, int *height) {
+	*x = 0;
+	*y = 0;
+	*width = buffer_width;
+	*height = buffer_height;
+	if (mode != BACKGROUND_MODE_CENTER && mode != BACKGROUND_MODE_FIT) {
+		return;
+	}
+
+	double image_width = cairo_image_surface_get_width(image);
+	double image_height = cairo_image_surface_get_height(image);
+	double scale = 1;
+	if (mode == BACKGROUND_MODE_FIT) {
+		scale = fmin(buffer_width / image_width, buffer_height / image_height);
+	}
+	double left = (double)buffer_width / 2 - image_width * scale / 2;
+	double top = (double)buffer_height / 2 - image_height * scale / 2;
+	if (mode == BACKGROUND_MODE_CENTER) {
+		left = (int)left;
+		top = (int)top;
+	}
+
+	// Bilinear filtering blurs the edges by up to half a source pixel
+	double margin = ceil(fmax(scale, 1) / 2) + 1;
+	int x0 = floor((left - margin) / align) * align;
+	int y0 = floor((top - margin) / align) * align;
+	int x1 = ceil((left + image_width * scale + margin) / align) * align;
+	int y1 = ceil((top + image_height * scale + margin) / align) * align;
+	x0 = x0 > 0 ? x0 : 0;
+	y0 = y0 > 0 ? y0 : 0;
+	x1 = x1 < buffer_width ? x1 : buffer_width;
+	y1 = y1 < buffer_height ? y1 : buffer_height;
+	if (x1 > x0 && y1 > y0) {
+		*x = x0;
+		*y = y0;
+		*width = x1 - x0;
+		*height = y1 - y0;
+	}
+}
+
+// Ordered dithering thresholds, 0 to 15
+static const uint8_t bayer4[4][4] = {
+	{ 0,  8,  2, 10},
+	{12,  4, 14,  6},
+	{ 3, 11,  1,  9},
+	{15,  7, 13,  5},
+};
+
+#ifdef USE_SSE
+// Packs 4 pixels which already had the dither added
+static inline SSSE3 __m128i pack565_4(__m128i v) {
+	__m128i r = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xF800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x07E0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001F));
+	v = _mm_or_si128(_mm_or_si128(r, g), b);
+	// Sign extend, so that packing with signed saturation keeps all bits
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+// Packs the start of a row, 8 pixels at a time, and returns
+// the first pixel left for the scalar loop.
+static SSSE3 int pack565_row(uint16_t *out, const uint32_t *in, int width,
+		const uint32_t *dither) {
+	__m128i dv = _mm_loadu_si128((const __m128i *)dither);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i a = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(in + x)), dv);
+		__m128i b = _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(in + x + 4)), dv);
+		_mm_storeu_si128((__m128i *)(out + x),
+				_mm_packs_epi32(pack565_4(a), pack565_4(b)));
+	}
+	return x;
+}
+#endif
+
+void pack_rgb565(void *dest, int dest_stride, cairo_surface_t *image) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int stride = cairo_image_surface_get_stride(image);
+	cairo_surface_flush(image);
+	unsigned char *src = cairo_image_surface_get_data(image);
+
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y) {
+		const uint32_t *in = (const uint32_t *)(src + (size_t)y * stride);
+		uint16_t *out = (uint16_t *)((unsigned char *)dest + (size_t)y * dest_stride);
+
+		// Red and blue lose 3 bits, green 2
+		uint32_t dither[4];
+		for (int i = 0; i < 4; ++i) {
+			uint32_t d = bayer4[y & 3][i];
+			dither[i] = (d / 2) << 16 | (d / 4) << 8 | (d / 2);
+		}
+
+		int x = 0;
+#ifdef USE_SSE
+		if (__builtin_cpu_supports("ssse3")) {
+			x = pack565_row(out, in, width, dither);
+		}
+#endif
+		for (; x < width; ++x) {
+			uint32_t p = in[x], d = dither[x & 3];
+			uint32_t r = ((p >> 16) & 0xFF) + ((d >> 16) & 0xFF);
+			uint32_t g = ((p >> 8) & 0xFF) + ((d >> 8) & 0xFF);
+			uint32_t b = (p & 0xFF) + (d & 0xFF);
+			r = r < 255 ? r : 255;
+			g = g < 255 ? g : 255;
+			b = b < 255 ? b : 255;
+			out[x] = (r >> 3) << 11 | (g >> 2) << 5 | (b >> 3);
+		}
+	}
+}
+
+cairo_surface_t *downscale_background_image(cairo_surface_t *image,
+		int factor) {
+	for (; factor > 1; factor /= 2) {
+		cairo_surface_t *half = halve_image(image);
+		if (half == NULL) {
+			break;
+		}
+		cairo_surface_destroy(image);
+		image = half;
+	}
+	return image;
+}
+
+struct prescale_job {
+	cairo_surface_t *source;
+	enum background_mode mode;
+	int buffer_width, buffer_height;
+	int x, y;
+};
+
+static void paint_prescaled_stripe(cairo_t *cairo, void *data) {
+	struct prescale_job *job = data;
+	cairo_surface_t *source = cairo_image_surface_alias(job->source);
+	cairo_translate(cairo, -job->x, -job->y);
+	render_background_image(cairo, source, job->mode,
+			job->buffer_width, job->buffer_height, 1);
+	cairo_surface_destroy(source);
+}
+
+cairo_surface_t *prescale_background_image(cairo_surface_t *image,
+		enum background_mode mode, int buffer_width, int buffer_height,
+		int align, int *x, int *y) {
+	// An image of exactly the buffer's size looks the same in every mode,
+	// and needs no copy
+	if (cairo_image_surface_get_width(image) == buffer_width &&
+			cairo_image_surface_get_height(image) == buffer_height) {
+		*x = 0;
+		*y = 0;
+		return cairo_surface_reference(image);
+	}
+
+	cairo_surface_t *source = cairo_surface_reference(image);
+	if (mode == BACKGROUND_MODE_STRETCH || mode == BACKGROUND_MODE_FILL ||
+			mode == BACKGROUND_MODE_FIT) {
+		// cairo's bilinear filter only samples 4 source pixels for each
+		// buffer pixel, so larger reductions alias. Go down a mip pyramid
+		// until less than 2x is left for cairo.
+		while (true) {
+			int width = cairo_image_surface_get_width(source);
+			int height = cairo_image_surface_get_height(source);
+			double scale_x = (double)buffer_width / width;
+			double scale_y = (double)buffer_height / height;
+			if (scale_x > 0.5 || scale_y > 0.5 || width < 2 || height < 2) {
+				break;
+			}
+			cairo_surface_t *half = halve_image(source);
+			if (half == NULL) {
+				break;
+			}
+			cairo_surface_destroy(source);
+			source = half;
+		}
+	}
+
+	// Opaque images which cover the whole buffer stay opaque, which lets
+	// cairo copy them instead of blending
+	bool opaque = cairo_surface_get_content(image) == CAIRO_CONTENT_COLOR &&
+		(mode == BACKGROUND_MODE_STRETCH || mode == BACKGROUND_MODE_FILL ||
+		 mode == BACKGROUND_MODE_TILE);
+	int width, height;
+	background_image_region(image, mode, buffer_width, buffer_height, align,
+			x, y, &width, &height);
+	cairo_surface_t *prescaled = cairo_image_surface_create(
+			opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32, width, height);
+	struct prescale_job job = {
+		.source = source,
+		.mode = mode,
+		.buffer_width = buffer_width,
+		.buffer_height = buffer_height,
+		.x = *x,
+		.y = *y,
+	};
+	cairo_image_surface_paint_striped(prescaled, paint_prescaled_stripe, &job);
+	cairo_surface_destroy(source);
+	return prescaled;
+}
+
+cairo_surface_t *prescaled_image_get(struct prescaled_image *prescaled,
+		cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height, int align) {
+	if (prescaled->source == image && prescaled->width == buffer_width &&
+			prescaled->height == buffer_height && prescaled->align == align) {
+		return prescaled->image;
+	}
+
+	prescaled_image_finish(prescaled);
+	prescaled->image = prescale_background_image(image, mode,
+			buffer_width, buffer_height, align, &prescaled->x, &prescaled->y);
+	prescaled->source = cairo_surface_reference(image);
+	prescaled->width = buffer_width;
+	prescaled->height = buffer_height;
+	prescaled->align = align;
+	return prescaled->image;
+}
+
+void prescaled_image_finish(struct prescaled_image *prescaled) {
+	if (prescaled->image) {
+		cairo_surface_destroy(prescaled->image);
+	}
+	if (prescaled->source) {
+		cairo_surface_destroy(prescaled->source);
+	}
+	*prescaled = (struct prescaled_image){0};
+}
+
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height, double alpha) {
 	double width = cairo_image_surface_get_width(image);
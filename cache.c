@@ -0,0 +1,287 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "background-image.h"
+#include "cache.h"
+#include "log.h"
+
+// Processed backgrounds are evicted, least recently used first, once they
+// take up more than this.
+#define BACKGROUND_CACHE_LIMIT ((off_t)512 * 1024 * 1024)
+
+static char *cache_dir = NULL;
+static char *background_dir = NULL;
+static pthread_once_t cache_dir_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_cache_dir(void) {
+	char *path;
+	char *xdgdir = getenv("XDG_CACHE_HOME");
+	if (xdgdir && xdgdir[0]) {
+		path = malloc(strlen(xdgdir) + strlen("/swaylock") + 1);
+		strcpy(path, xdgdir);
+	} else {
+		char *homedir = getenv("HOME");
+		if (homedir == NULL) {
+			swaylock_log(LOG_ERROR,
+					"No cache directory; neither $HOME nor $XDG_CACHE_HOME "
+					"is defined.");
+			return;
+		}
+
+		path = malloc(strlen(homedir) + strlen("/.cache/swaylock") + 1);
+		sprintf(path, "%s/.cache", homedir);
+	}
+	// The base directory might not exist yet either
+	mkdir(path, 0700);
+	strcat(path, "/swaylock");
+
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		swaylock_log(LOG_ERROR, "No cache directory; mkdir %s failed: %s",
+				path, strerror(errno));
+		free(path);
+		return;
+	}
+	cache_dir = path;
+
+	path = malloc(strlen(cache_dir) + strlen("/backgrounds") + 1);
+	sprintf(path, "%s/backgrounds", cache_dir);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		swaylock_log(LOG_ERROR, "Can't cache backgrounds; mkdir %s failed: %s",
+				path, strerror(errno));
+		free(path);
+		return;
+	}
+	background_dir = path;
+}
+
+const char *swaylock_cache_dir(void) {
+	pthread_once(&cache_dir_once, init_cache_dir);
+	return cache_dir;
+}
+
+static void print_file_stamp(FILE *f, const char *path) {
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		fprintf(f, " %s@%lld.%09ld/%lld", path, (long long)st.st_mtim.tv_sec,
+				st.st_mtim.tv_nsec, (long long)st.st_size);
+	} else {
+		fprintf(f, " %s", path);
+	}
+}
+
+static void print_screen_pos(FILE *f, struct swaylock_effect_screen_pos *pos) {
+	fprintf(f, " %a%s", pos->pos, pos->is_percent ? "%" : "");
+}
+
+char *background_cache_key(const char *path, int width, int height,
+		enum background_mode mode, struct swaylock_effect *effects, int count,
+		bool planar, int downscale) {
+	char *abspath = realpath(path, NULL);
+	if (abspath == NULL) {
+		return NULL;
+	}
+
+	char *key;
+	size_t len;
+	FILE *f = open_memstream(&key, &len);
+	if (f == NULL) {
+		free(abspath);
+		return NULL;
+	}
+
+	// Changing the file changes its mtime or size, so stale entries are
+	// never hit; they just age out.
+	print_file_stamp(f, abspath);
+	free(abspath);
+	fprintf(f, " %dx%d mode=%d planar=%d downscale=%d", width, height, mode,
+			planar, downscale);
+
+	for (int i = 0; i < count; ++i) {
+		struct swaylock_effect *effect = &effects[i];
+		switch (effect->tag) {
+		case EFFECT_BLUR:
+			fprintf(f, " blur %dx%d", effect->e.blur.radius, effect->e.blur.times);
+			break;
+		case EFFECT_PIXELATE:
+			fprintf(f, " pixelate %d", effect->e.pixelate.factor);
+			break;
+		case EFFECT_SCALE:
+			fprintf(f, " scale %a", effect->e.scale);
+			break;
+		case EFFECT_GREYSCALE:
+			fprintf(f, " greyscale");
+			break;
+		case EFFECT_VIGNETTE:
+			fprintf(f, " vignette %a:%a", effect->e.vignette.base,
+					effect->e.vignette.factor);
+			break;
+		case EFFECT_COMPOSE:
+			fprintf(f, " compose");
+			print_screen_pos(f, &effect->e.compose.x);
+			print_screen_pos(f, &effect->e.compose.y);
+			print_screen_pos(f, &effect->e.compose.w);
+			print_screen_pos(f, &effect->e.compose.h);
+			fprintf(f, " %d", effect->e.compose.gravity);
+			print_file_stamp(f, effect->e.compose.imgpath);
+			break;
+		case EFFECT_CUSTOM:
+			fprintf(f, " custom");
+			print_file_stamp(f, effect->e.custom);
+			break;
+		}
+	}
+
+	if (fclose(f) != 0) {
+		free(key);
+		return NULL;
+	}
+	return key;
+}
+
+static char *background_cache_path(const char *key) {
+	pthread_once(&cache_dir_once, init_cache_dir);
+	if (background_dir == NULL) {
+		return NULL;
+	}
+
+	// 64-bit FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (const char *ch = key; *ch; ++ch) {
+		hash = (hash ^ (unsigned char)*ch) * 0x100000001b3;
+	}
+
+	char *path = malloc(strlen(background_dir) + 1 + 16 + strlen(".raw") + 1);
+	sprintf(path, "%s/%016" PRIx64 ".raw", background_dir, hash);
+	return path;
+}
+
+cairo_surface_t *background_cache_load(const char *key) {
+	char *path = background_cache_path(key);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	cairo_surface_t *image = NULL;
+	if (access(path, R_OK) == 0) {
+		// Entries are named by a hash of the key and store the key itself,
+		// so a colliding entry is a miss rather than the wrong background
+		image = load_raw_image(path, key);
+		if (image) {
+			// The mtime of an entry is when it was last used
+			utimensat(AT_FDCWD, path, NULL, 0);
+		} else {
+			unlink(path);
+		}
+	}
+	free(path);
+	return image;
+}
+
+struct cache_entry {
+	char *name;
+	off_t size;
+	struct timespec used;
+};
+
+static int compare_cache_entries(const void *a, const void *b) {
+	const struct cache_entry *ea = a, *eb = b;
+	if (ea->used.tv_sec != eb->used.tv_sec) {
+		return ea->used.tv_sec < eb->used.tv_sec ? -1 : 1;
+	}
+	if (ea->used.tv_nsec != eb->used.tv_nsec) {
+		return ea->used.tv_nsec < eb->used.tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
+static void prune_background_cache(void) {
+	DIR *dir = opendir(background_dir);
+	if (dir == NULL) {
+		return;
+	}
+
+	int fd = dirfd(dir);
+	struct cache_entry *entries = NULL;
+	size_t n_entries = 0, cap = 0;
+	off_t total = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		size_t len = strlen(ent->d_name);
+		struct stat st;
+		if (len < 4 || strcmp(ent->d_name + len - 4, ".raw") != 0 ||
+				fstatat(fd, ent->d_name, &st, 0) != 0) {
+			continue;
+		}
+		if (n_entries == cap) {
+			cap = cap ? cap * 2 : 16;
+			entries = realloc(entries, cap * sizeof(*entries));
+		}
+		entries[n_entries++] = (struct cache_entry){
+			.name = strdup(ent->d_name),
+			.size = st.st_size,
+			.used = st.st_mtim,
+		};
+		total += st.st_size;
+	}
+
+	if (total > BACKGROUND_CACHE_LIMIT) {
+		qsort(entries, n_entries, sizeof(*entries), compare_cache_entries);
+		// Never evict the most recent entry, which was just stored
+		for (size_t i = 0; i + 1 < n_entries && total > BACKGROUND_CACHE_LIMIT; ++i) {
+			swaylock_log(LOG_DEBUG, "Evicting cached background %s",
+					entries[i].name);
+			if (unlinkat(fd, entries[i].name, 0) == 0) {
+				total -= entries[i].size;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < n_entries; ++i) {
+		free(entries[i].name);
+	}
+	free(entries);
+	closedir(dir);
+}
+
+void background_cache_store(const char *key, cairo_surface_t *image) {
+	char *path = background_cache_path(key);
+	if (path == NULL) {
+		return;
+	}
+
+	// Written to a temporary file first, so a crash never leaves a
+	// truncated entry, and concurrent lockers never see one
+	char *tmppath = malloc(strlen(path) + strlen(".XXXXXX") + 1);
+	sprintf(tmppath, "%s.XXXXXX", path);
+	int fd = mkstemp(tmppath);
+	if (fd < 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to create %s", tmppath);
+		free(tmppath);
+		free(path);
+		return;
+	}
+	close(fd);
+
+	if (write_raw_image(image, key, tmppath) && rename(tmppath, path) == 0) {
+		swaylock_log(LOG_DEBUG, "Cached background as %s", path);
+	} else {
+		unlink(tmppath);
+	}
+	free(tmppath);
+	free(path);
+
+	pthread_mutex_lock(&prune_lock);
+	prune_background_cache();
+	pthread_mutex_unlock(&prune_lock);
+}
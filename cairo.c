@@ -1,3 +1,4 @@
+#include <omp.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,11 @@
 #if HAVE_GDK_PIXBUF
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #endif
+#ifdef USE_SSE
+#include <tmmintrin.h>
+// Only the kernels are built for SSSE3; callers check the CPU first
+#define SSSE3 __attribute__((target("ssse3")))
+#endif
 
 void cairo_set_source_u32(cairo_t *cairo, uint32_t color) {
 	cairo_set_source_rgba(cairo,
@@ -37,13 +43,199 @@ cairo_surface_t *cairo_surface_duplicate(cairo_surface_t *src) {
 	uint32_t width = cairo_image_surface_get_width(src);
 	cairo_format_t format = cairo_image_surface_get_format(src);
 
-	void *new_data = malloc(stride * height);
-	memcpy(new_data, cairo_image_surface_get_data(src), stride * height);
+	// Let cairo own the copy, so that it's freed along with the surface
+	cairo_surface_t *dest = cairo_image_surface_create(format, width, height);
+	if (cairo_surface_status(dest) != CAIRO_STATUS_SUCCESS) {
+		return dest;
+	}
+
+	// 'src' may wrap foreign memory with a different stride
+	cairo_surface_flush(src);
+	uint32_t dest_stride = cairo_image_surface_get_stride(dest);
+	uint32_t row_size = stride < dest_stride ? stride : dest_stride;
+	unsigned char *src_data = cairo_image_surface_get_data(src);
+	unsigned char *dest_data = cairo_image_surface_get_data(dest);
+	for (uint32_t y = 0; y < height; ++y) {
+		memcpy(dest_data + (size_t)y * dest_stride,
+				src_data + (size_t)y * stride, row_size);
+	}
+	cairo_surface_mark_dirty(dest);
+	return dest;
+}
+
+cairo_surface_t *cairo_image_surface_alias(cairo_surface_t *image) {
+	return cairo_image_surface_create_for_data(
+			cairo_image_surface_get_data(image),
+			cairo_image_surface_get_format(image),
+			cairo_image_surface_get_width(image),
+			cairo_image_surface_get_height(image),
+			cairo_image_surface_get_stride(image));
+}
+
+// Stripes are at least this many rows, so that each is worth a thread
+#define STRIPE_MIN_ROWS 128
+
+void cairo_image_surface_paint_striped(cairo_surface_t *surface,
+		void (*paint)(cairo_t *cairo, void *data), void *data) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	cairo_format_t format = cairo_image_surface_get_format(surface);
 
-	return cairo_image_surface_create_for_data(new_data, format, width, height, stride);
+	int nstripes = height / STRIPE_MIN_ROWS;
+	if (nstripes > omp_get_max_threads()) {
+		nstripes = omp_get_max_threads();
+	}
+	if (nstripes < 2) {
+		cairo_t *cairo = cairo_create(surface);
+		paint(cairo, data);
+		cairo_destroy(cairo);
+		return;
+	}
+
+	cairo_surface_flush(surface);
+	unsigned char *pixels = cairo_image_surface_get_data(surface);
+#pragma omp parallel for
+	for (int i = 0; i < nstripes; ++i) {
+		int y0 = (int)((long)height * i / nstripes);
+		int y1 = (int)((long)height * (i + 1) / nstripes);
+		cairo_surface_t *stripe = cairo_image_surface_create_for_data(
+				pixels + (size_t)y0 * stride, format, width, y1 - y0, stride);
+		cairo_t *cairo = cairo_create(stripe);
+		cairo_translate(cairo, 0, -y0);
+		paint(cairo, data);
+		cairo_destroy(cairo);
+		cairo_surface_destroy(stripe);
+	}
+	cairo_surface_mark_dirty(surface);
 }
 
 #if HAVE_GDK_PIXBUF
+/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
+ * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
+ *         = z/256 + (z/256)/255 = (z + z/255)/256
+ *         # recurse once
+ *         = (z + (z + z/255)/256)/256
+ *         = (z + z/256 + z/256/255) / 256
+ *         # only use 16bit uint operations, loose some precision,
+ *         # result is floored.
+ *       ->  (z + z>>8)>>8
+ *         # add 0x80/255 = 0.5 to convert floor to round
+ *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
+ * ------
+ * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
+ */
+#define PREMUL_ALPHA(x,a,b,z) \
+	G_STMT_START { z = a * b + 0x80; x = (z + (z >> 8)) >> 8; } \
+	G_STMT_END
+
+#if defined(USE_SSE) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+// Swizzles 4 RGB pixels (the low 12 bytes) to BGRX, with X = 0.
+static inline SSSE3 __m128i import_rgb4(__m128i rgb) {
+	const __m128i shuf = _mm_setr_epi8(
+			2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	return _mm_shuffle_epi8(rgb, shuf);
+}
+
+// Premultiplies 2 BGRA pixels widened to 16 bits, exactly like
+// PREMUL_ALPHA. Alpha is multiplied by 255, which leaves it as it is.
+static inline SSSE3 __m128i premul2(__m128i bgra, __m128i alpha) {
+	__m128i z = _mm_add_epi16(_mm_mullo_epi16(bgra, alpha), _mm_set1_epi16(0x80));
+	return _mm_srli_epi16(_mm_add_epi16(z, _mm_srli_epi16(z, 8)), 8);
+}
+
+// Swizzles 4 RGBA pixels to BGRA and premultiplies them.
+static inline SSSE3 __m128i import_rgba4(__m128i rgba) {
+	const __m128i shuf = _mm_setr_epi8(
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	const __m128i alpha_lo = _mm_setr_epi8(
+			3, -1, 3, -1, 3, -1, -1, -1, 7, -1, 7, -1, 7, -1, -1, -1);
+	const __m128i alpha_hi = _mm_setr_epi8(
+			11, -1, 11, -1, 11, -1, -1, -1, 15, -1, 15, -1, 15, -1, -1, -1);
+	const __m128i alpha_one = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+	const __m128i zero = _mm_setzero_si128();
+
+	__m128i bgra = _mm_shuffle_epi8(rgba, shuf);
+	__m128i lo = premul2(_mm_unpacklo_epi8(bgra, zero),
+			_mm_or_si128(_mm_shuffle_epi8(rgba, alpha_lo), alpha_one));
+	__m128i hi = premul2(_mm_unpackhi_epi8(bgra, zero),
+			_mm_or_si128(_mm_shuffle_epi8(rgba, alpha_hi), alpha_one));
+	return _mm_packus_epi16(lo, hi);
+}
+
+// These import the start of a row and return the first pixel left
+// for the scalar loop.
+static SSSE3 int import_rgb_simd(const guint8 *gp, unsigned char *cp, int w) {
+	int x = 0;
+	// Each load reads 16 bytes for 12 bytes of pixels
+	for (; x + 6 <= w; x += 4) {
+		__m128i rgb = _mm_loadu_si128((const __m128i *)(gp + 3 * x));
+		_mm_storeu_si128((__m128i *)(cp + 4 * x), import_rgb4(rgb));
+	}
+	return x;
+}
+
+static SSSE3 int import_rgba_simd(const guint8 *gp, unsigned char *cp, int w) {
+	int x = 0;
+	for (; x + 4 <= w; x += 4) {
+		__m128i rgba = _mm_loadu_si128((const __m128i *)(gp + 4 * x));
+		_mm_storeu_si128((__m128i *)(cp + 4 * x), import_rgba4(rgba));
+	}
+	return x;
+}
+#define HAVE_SIMD_IMPORT 1
+#else
+#define HAVE_SIMD_IMPORT 0
+#endif
+
+static void import_rgb_row(const guint8 *gp, unsigned char *cp, int w) {
+	int x = 0;
+#if HAVE_SIMD_IMPORT
+	if (__builtin_cpu_supports("ssse3")) {
+		x = import_rgb_simd(gp, cp, w);
+	}
+#endif
+	for (; x < w; ++x) {
+		const guint8 *p = gp + 3 * x;
+		unsigned char *c = cp + 4 * x;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		c[0] = p[2];
+		c[1] = p[1];
+		c[2] = p[0];
+#else
+		c[1] = p[0];
+		c[2] = p[1];
+		c[3] = p[2];
+#endif
+	}
+}
+
+static void import_rgba_row(const guint8 *gp, unsigned char *cp, int w) {
+	int x = 0;
+#if HAVE_SIMD_IMPORT
+	if (__builtin_cpu_supports("ssse3")) {
+		x = import_rgba_simd(gp, cp, w);
+	}
+#endif
+	guint z1, z2, z3;
+	for (; x < w; ++x) {
+		const guint8 *p = gp + 4 * x;
+		unsigned char *c = cp + 4 * x;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		PREMUL_ALPHA(c[0], p[2], p[3], z1);
+		PREMUL_ALPHA(c[1], p[1], p[3], z2);
+		PREMUL_ALPHA(c[2], p[0], p[3], z3);
+		c[3] = p[3];
+#else
+		PREMUL_ALPHA(c[1], p[0], p[3], z1);
+		PREMUL_ALPHA(c[2], p[1], p[3], z2);
+		PREMUL_ALPHA(c[3], p[2], p[3], z3);
+		c[0] = p[3];
+#endif
+	}
+}
+#undef PREMUL_ALPHA
+
 cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdkbuf) {
 	int chan = gdk_pixbuf_get_n_channels(gdkbuf);
 	if (chan < 3) {
@@ -68,71 +260,15 @@ cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdk
 	int cstride = cairo_image_surface_get_stride(cs);
 	unsigned char * cpix = cairo_image_surface_get_data(cs);
 
-	if (chan == 3) {
-		int i;
-		for (i = h; i; --i) {
-			const guint8 *gp = gdkpix;
-			unsigned char *cp = cpix;
-			const guint8* end = gp + 3*w;
-			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-				cp[0] = gp[2];
-				cp[1] = gp[1];
-				cp[2] = gp[0];
-#else
-				cp[1] = gp[0];
-				cp[2] = gp[1];
-				cp[3] = gp[2];
-#endif
-				gp += 3;
-				cp += 4;
-			}
-			gdkpix += stride;
-			cpix += cstride;
+#pragma omp parallel for schedule(static)
+	for (int y = 0; y < h; ++y) {
+		const guint8 *gp = gdkpix + (size_t)y * stride;
+		unsigned char *cp = cpix + (size_t)y * cstride;
+		if (chan == 3) {
+			import_rgb_row(gp, cp, w);
+		} else {
+			import_rgba_row(gp, cp, w);
 		}
-	} else {
-		/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
-		 * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
-		 *         = z/256 + (z/256)/255 = (z + z/255)/256
-		 *         # recurse once
-		 *         = (z + (z + z/255)/256)/256
-		 *         = (z + z/256 + z/256/255) / 256
-		 *         # only use 16bit uint operations, loose some precision,
-		 *         # result is floored.
-		 *       ->  (z + z>>8)>>8
-		 *         # add 0x80/255 = 0.5 to convert floor to round
-		 *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
-		 * ------
-		 * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
-		 */
-#define PREMUL_ALPHA(x,a,b,z) \
-		G_STMT_START { z = a * b + 0x80; x = (z + (z >> 8)) >> 8; } \
-		G_STMT_END
-		int i;
-		for (i = h; i; --i) {
-			const guint8 *gp = gdkpix;
-			unsigned char *cp = cpix;
-			const guint8* end = gp + 4*w;
-			guint z1, z2, z3;
-			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-				PREMUL_ALPHA(cp[0], gp[2], gp[3], z1);
-				PREMUL_ALPHA(cp[1], gp[1], gp[3], z2);
-				PREMUL_ALPHA(cp[2], gp[0], gp[3], z3);
-				cp[3] = gp[3];
-#else
-				PREMUL_ALPHA(cp[1], gp[0], gp[3], z1);
-				PREMUL_ALPHA(cp[2], gp[1], gp[3], z2);
-				PREMUL_ALPHA(cp[3], gp[2], gp[3], z3);
-				cp[0] = gp[3];
-#endif
-				gp += 4;
-				cp += 4;
-			}
-			gdkpix += stride;
-			cpix += cstride;
-		}
-#undef PREMUL_ALPHA
 	}
 	cairo_surface_mark_dirty(cs);
 	return cs;
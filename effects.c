@@ -2,6 +2,8 @@
 #define _XOPEN_SOURCE 700
 #include <omp.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <dlfcn.h>
@@ -14,8 +16,10 @@
 #include <spawn.h>
 #include <time.h>
 #include <stdio.h>
+#include "cache.h"
 #include "effects.h"
 #include "log.h"
+#include "shm-allocator.h"
 
 // glib might or might not have already defined MIN,
 // depending on whether we have pixbuf or not...
@@ -25,6 +29,26 @@
 
 extern char **environ;
 
+static struct shm_allocator *output_shm = NULL;
+
+void swaylock_effects_set_allocator(struct shm_allocator *shm) {
+	output_shm = shm;
+}
+
+// Effects which don't work in place write into a new surface. Those live in
+// shared memory, so that whichever ends up as the result can be attached to
+// an output as it is.
+static cairo_surface_t *create_effect_surface(int width, int height) {
+	if (output_shm) {
+		cairo_surface_t *surf = shm_image_create(output_shm,
+				CAIRO_FORMAT_RGB24, width, height);
+		if (surf) {
+			return surf;
+		}
+	}
+	return cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+}
+
 static int screen_size_to_pix(struct swaylock_effect_screen_pos size, int screensize, int scale) {
 	if (size.is_percent) {
 		return (size.pos / 100.0) * screensize;
@@ -231,11 +255,10 @@ static void blur_once(uint32_t *dest, uint32_t *src, uint32_t *scratch,
 // This effect_blur function, and the associated blur_* functions,
 // are my own adaptations of code in yvbbrjdr's i3lock-fancy-rapid:
 // https://github.com/yvbbrjdr/i3lock-fancy-rapid
-static void effect_blur(uint32_t *dest, uint32_t *src, int width, int height, int scale,
-		int radius, int times) {
-	uint32_t *origdest = dest;
-
-	uint32_t *scratch = malloc(width * height * sizeof(*scratch));
+// We're flipping between using dest and src; the returned pointer is
+// whichever of the two ended up with the result.
+static uint32_t *effect_blur(uint32_t *dest, uint32_t *src, uint32_t *scratch,
+		int width, int height, int scale, int radius, int times) {
 	blur_once(dest, src, scratch, width, height, radius * scale);
 	for (int i = 0; i < times - 1; ++i) {
 		uint32_t *tmp = src;
@@ -243,25 +266,28 @@ static void effect_blur(uint32_t *dest, uint32_t *src, int width, int height, in
 		dest = tmp;
 		blur_once(dest, src, scratch, width, height, radius * scale);
 	}
-	free(scratch);
 
-	// We're flipping between using dest and src;
-	// if the last buffer we used was src, copy that over to dest.
-	if (dest != origdest)
-		memcpy(origdest, dest, width * height * sizeof(*dest));
+	return dest;
 }
 
-static void effect_pixelate(uint32_t *data, int width, int height, int scale, int factor) {
+// 'yoff' is the row of the full image that data's first row corresponds to,
+// so that the pixel grid stays anchored to the full image when only a band
+// of it is being processed.
+static void effect_pixelate(uint32_t *data, int width, int height, int yoff,
+		int scale, int factor) {
 	factor *= scale;
+	int first_block = yoff / factor;
+	int last_block = (yoff + height - 1) / factor;
 #pragma omp parallel for
-	for (int y = 0; y < height / factor + 1; ++y) {
+	for (int y = first_block; y <= last_block; ++y) {
 		for (int x = 0; x < width / factor + 1; ++x) {
 			int total_r = 0, total_g = 0, total_b = 0;
 
 			int xstart = x * factor;
-			int ystart = y * factor;
+			int ystart = y * factor - yoff;
 			int xlim = MIN(xstart + factor, width);
 			int ylim = MIN(ystart + factor, height);
+			if (ystart < 0) ystart = 0;
 
 			// Average
 			for (int ry = ystart; ry < ylim; ++ry) {
@@ -323,8 +349,10 @@ static void effect_greyscale(uint32_t *data, int width, int height) {
 	}
 }
 
+// Like effect_pixelate, 'yoff' and 'full_height' describe where data's rows
+// are located in the full image.
 static void effect_vignette(uint32_t *data, int width, int height,
-		double base, double factor) {
+		int yoff, int full_height, double base, double factor) {
 	base = fmin(1, fmax(0, base));
 	factor = fmin(1 - base, fmax(0, factor));
 #pragma omp parallel for
@@ -332,7 +360,7 @@ static void effect_vignette(uint32_t *data, int width, int height,
 		for (int x = 0; x < width; ++x) {
 
 			double xf = (x * 1.0) / width;
-			double yf = (y * 1.0) / height;
+			double yf = ((y + yoff) * 1.0) / full_height;
 			double vignette_factor = base + factor
 				* 16 * xf * yf * (1.0 - xf) * (1.0 - yf);
 
@@ -480,35 +508,12 @@ static bool file_is_outdated(const char *input, const char *output) {
 }
 
 static char *effect_custom_compile(const char *path) {
-	static char *cachepath = NULL;
-	static size_t cachelen;
+	const char *cachepath = swaylock_cache_dir();
 	if (!cachepath) {
-		char *xdgdir = getenv("XDG_DATA_HOME");
-		if (xdgdir) {
-			cachepath = malloc(strlen(xdgdir) + strlen("/swaylock") + 1);
-			cachelen = sprintf(cachepath, "%s/swaylock", xdgdir);
-		} else {
-			char *homedir = getenv("HOME");
-			if (homedir == NULL) {
-				swaylock_log(LOG_ERROR,
-						"Can't compile custom effect; neither $HOME nor $XDG_CONFIG_HOME "
-						"is defined.");
-				return NULL;
-			}
-
-			cachepath = malloc(strlen(homedir) + strlen("/.cache/swaylock") + 1);
-			cachelen = sprintf(cachepath, "%s/.cache/swaylock", homedir);
-		}
-
-		if (mkdir(cachepath, 0777) < 0 && errno != EEXIST) {
-			swaylock_log(LOG_ERROR,
-					"Can't compile custom effect; mkdir %s failed: %s\n",
-					cachepath, strerror(errno));
-			free(cachepath);
-			cachepath = NULL;
-			return NULL;
-		}
+		swaylock_log(LOG_ERROR, "Can't compile custom effect without a cache directory.");
+		return NULL;
 	}
+	size_t cachelen = strlen(cachepath);
 
 	// Find the true, absolute path of the input file
 	char *abspath = realpath(path, NULL);
@@ -563,7 +568,12 @@ static void effect_custom(uint32_t *data, int width, int height, int scale,
 	if (pathlen > 3 && strcmp(path + pathlen - 3, ".so") == 0) {
 		effect_custom_run(data, width, height, scale, path);
 	} else if (pathlen > 2 && strcmp(path + pathlen - 2, ".c") == 0) {
+		// Effects may run on several outputs at once;
+		// only one of them should compile the effect.
+		static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+		pthread_mutex_lock(&compile_lock);
 		char *compiled = effect_custom_compile(path);
+		pthread_mutex_unlock(&compile_lock);
 		if (compiled != NULL) {
 			effect_custom_run(data, width, height, scale, compiled);
 			free(compiled);
@@ -579,8 +589,7 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 		struct swaylock_effect *effect) {
 	switch (effect->tag) {
 	case EFFECT_BLUR: {
-		cairo_surface_t *surf = cairo_image_surface_create(
-				CAIRO_FORMAT_RGB24,
+		cairo_surface_t *surf = create_effect_surface(
 				cairo_image_surface_get_width(surface),
 				cairo_image_surface_get_height(surface));
 
@@ -590,16 +599,34 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 			break;
 		}
 
-		effect_blur(
+		uint32_t *scratch = malloc(
+				(size_t)cairo_image_surface_get_width(surface) *
+				cairo_image_surface_get_height(surface) * sizeof(*scratch));
+		if (scratch == NULL) {
+			swaylock_log(LOG_ERROR, "Failed to allocate scratch buffer for blur effect");
+			cairo_surface_destroy(surf);
+			break;
+		}
+
+		uint32_t *res = effect_blur(
 				(uint32_t *)cairo_image_surface_get_data(surf),
 				(uint32_t *)cairo_image_surface_get_data(surface),
+				scratch,
 				cairo_image_surface_get_width(surface),
 				cairo_image_surface_get_height(surface),
 				scale,
 				effect->e.blur.radius, effect->e.blur.times);
-		cairo_surface_flush(surf);
-		cairo_surface_destroy(surface);
-		surface = surf;
+		free(scratch);
+
+		// Keep whichever surface the blur ended in, rather than copying
+		if (res == (uint32_t *)cairo_image_surface_get_data(surface)) {
+			cairo_surface_destroy(surf);
+			cairo_surface_flush(surface);
+		} else {
+			cairo_surface_flush(surf);
+			cairo_surface_destroy(surface);
+			surface = surf;
+		}
 		break;
 	}
 
@@ -608,15 +635,14 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 				(uint32_t *)cairo_image_surface_get_data(surface),
 				cairo_image_surface_get_width(surface),
 				cairo_image_surface_get_height(surface),
-				scale,
+				0, scale,
 				effect->e.pixelate.factor);
 		cairo_surface_flush(surface);
 		break;
 	}
 
 	case EFFECT_SCALE: {
-		cairo_surface_t *surf = cairo_image_surface_create(
-				CAIRO_FORMAT_RGB24,
+		cairo_surface_t *surf = create_effect_surface(
 				cairo_image_surface_get_width(surface) * effect->e.scale,
 				cairo_image_surface_get_height(surface) * effect->e.scale);
 
@@ -652,6 +678,7 @@ static cairo_surface_t *run_effect(cairo_surface_t *surface, int scale,
 				(uint32_t *)cairo_image_surface_get_data(surface),
 				cairo_image_surface_get_width(surface),
 				cairo_image_surface_get_height(surface),
+				0, cairo_image_surface_get_height(surface),
 				effect->e.vignette.base,
 				effect->e.vignette.factor);
 		cairo_surface_flush(surface);
@@ -693,8 +720,7 @@ static cairo_surface_t *ensure_format(cairo_surface_t *surface) {
 	swaylock_log(LOG_DEBUG, "Have to convert surface to CAIRO_FORMAT_RGB24 from %i.",
 			(int)cairo_image_surface_get_format(surface));
 
-	cairo_surface_t *surf = cairo_image_surface_create(
-			CAIRO_FORMAT_RGB24,
+	cairo_surface_t *surf = create_effect_surface(
 			cairo_image_surface_get_width(surface),
 			cairo_image_surface_get_height(surface));
 	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
@@ -711,44 +737,699 @@ static cairo_surface_t *ensure_format(cairo_surface_t *surface) {
 	return surf;
 }
 
-cairo_surface_t *swaylock_effects_run(cairo_surface_t *surface, int scale,
+// The planar representation keeps the red, green and blue channels in
+// separate 16-bit planes, with 8 fractional bits. Converting to and from
+// packed XRGB happens once per run of planar effects, and the kernels below
+// then work on contiguous single-channel data. The extra precision also
+// keeps repeated box blurs from banding.
+struct planar_image {
+	int width, height;
+	uint16_t *planes[3]; // r, g, b
+};
+
+static bool effect_is_planar(struct swaylock_effect *effect) {
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+	case EFFECT_PIXELATE:
+	case EFFECT_SCALE:
+	case EFFECT_GREYSCALE:
+	case EFFECT_VIGNETTE:
+		return true;
+	case EFFECT_COMPOSE:
+	case EFFECT_CUSTOM:
+		return false;
+	}
+
+	abort();
+}
+
+static void planar_free(struct planar_image *img) {
+	for (int c = 0; c < 3; ++c) {
+		free(img->planes[c]);
+		img->planes[c] = NULL;
+	}
+}
+
+static bool planar_alloc(struct planar_image *img, int width, int height) {
+	img->width = width;
+	img->height = height;
+	for (int c = 0; c < 3; ++c) {
+		img->planes[c] = malloc((size_t)width * height * sizeof(uint16_t));
+		if (img->planes[c] == NULL) {
+			planar_free(img);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool planar_from_surface(struct planar_image *img, cairo_surface_t *surface) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	if (!planar_alloc(img, width, height)) {
+		return false;
+	}
+
+	uint32_t *data = (uint32_t *)cairo_image_surface_get_data(surface);
+	uint16_t *r = img->planes[0], *g = img->planes[1], *b = img->planes[2];
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			size_t index = (size_t)y * width + x;
+			r[index] = (data[index] & 0xff0000) >> 8;
+			g[index] = (data[index] & 0x00ff00);
+			b[index] = (data[index] & 0x0000ff) << 8;
+		}
+	}
+	return true;
+}
+
+static inline uint32_t planar_to_u8(uint16_t v) {
+	uint32_t res = ((uint32_t)v + 0x80) >> 8;
+	return res > 255 ? 255 : res;
+}
+
+static cairo_surface_t *planar_to_surface(struct planar_image *img) {
+	cairo_surface_t *surf = create_effect_surface(img->width, img->height);
+	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to create surface for planar effects");
+		cairo_surface_destroy(surf);
+		return NULL;
+	}
+
+	int width = img->width;
+	uint32_t *data = (uint32_t *)cairo_image_surface_get_data(surf);
+	uint16_t *r = img->planes[0], *g = img->planes[1], *b = img->planes[2];
+#pragma omp parallel for
+	for (int y = 0; y < img->height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			size_t index = (size_t)y * width + x;
+			data[index] = 0 |
+				planar_to_u8(r[index]) << 16 |
+				planar_to_u8(g[index]) << 8 |
+				planar_to_u8(b[index]);
+		}
+	}
+
+	cairo_surface_flush(surf);
+	return surf;
+}
+
+// The planar blurs use the same window as blur_h and blur_v:
+// output i averages input [i - radius + 1, i + radius], clipped to the image.
+static void planar_blur_h(uint16_t *dest, uint16_t *src, int width, int height,
+		int radius) {
+	const int minradius = radius < width ? radius : width;
+
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y) {
+		uint16_t *srow = src + (size_t)y * width;
+		uint16_t *drow = dest + (size_t)y * width;
+
+		uint32_t acc = 0;
+		float range = minradius;
+		for (int x = 0; x < minradius; ++x) {
+			acc += srow[x];
+		}
+
+		for (int x = 0; x < width; ++x) {
+			if (x >= minradius) {
+				acc -= srow[x - radius];
+				range -= 1;
+			}
+			if (x < width - minradius) {
+				acc += srow[x + radius];
+				range += 1;
+			}
+			drow[x] = acc / range + 0.5f;
+		}
+	}
+}
+
+// Works on whole rows at a time, so that the inner loops run over
+// contiguous memory. Columns are split into stripes across threads.
+#define PLANAR_BLUR_STRIPE 512
+static void planar_blur_v(uint16_t *dest, uint16_t *src, int width, int height,
+		int radius) {
+	const int minradius = radius < height ? radius : height;
+	int nstripes = (width + PLANAR_BLUR_STRIPE - 1) / PLANAR_BLUR_STRIPE;
+
+#pragma omp parallel for
+	for (int stripe = 0; stripe < nstripes; ++stripe) {
+		int x0 = stripe * PLANAR_BLUR_STRIPE;
+		int n = MIN(PLANAR_BLUR_STRIPE, width - x0);
+		uint32_t acc[PLANAR_BLUR_STRIPE] = {0};
+
+		for (int y = 0; y < minradius; ++y) {
+			uint16_t *srow = src + (size_t)y * width + x0;
+			for (int x = 0; x < n; ++x) {
+				acc[x] += srow[x];
+			}
+		}
+
+		float range = minradius;
+		for (int y = 0; y < height; ++y) {
+			if (y >= minradius) {
+				uint16_t *srow = src + (size_t)(y - radius) * width + x0;
+				for (int x = 0; x < n; ++x) {
+					acc[x] -= srow[x];
+				}
+				range -= 1;
+			}
+			if (y < height - minradius) {
+				uint16_t *srow = src + (size_t)(y + radius) * width + x0;
+				for (int x = 0; x < n; ++x) {
+					acc[x] += srow[x];
+				}
+				range += 1;
+			}
+
+			float inv_range = 1.0f / range;
+			uint16_t *drow = dest + (size_t)y * width + x0;
+			for (int x = 0; x < n; ++x) {
+				drow[x] = acc[x] * inv_range + 0.5f;
+			}
+		}
+	}
+}
+#undef PLANAR_BLUR_STRIPE
+
+static bool planar_blur(struct planar_image *img, int scale, int radius, int times) {
+	uint16_t *scratch = malloc((size_t)img->width * img->height * sizeof(*scratch));
+	if (scratch == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate scratch plane for blur effect");
+		return false;
+	}
+
+	for (int c = 0; c < 3; ++c) {
+		for (int i = 0; i < times; ++i) {
+			planar_blur_h(scratch, img->planes[c], img->width, img->height,
+					radius * scale);
+			planar_blur_v(img->planes[c], scratch, img->width, img->height,
+					radius * scale);
+		}
+	}
+
+	free(scratch);
+	return true;
+}
+
+static void planar_pixelate(struct planar_image *img, int scale, int factor) {
+	factor *= scale;
+	int width = img->width, height = img->height;
+	for (int c = 0; c < 3; ++c) {
+		uint16_t *data = img->planes[c];
+#pragma omp parallel for
+		for (int y = 0; y < height / factor + 1; ++y) {
+			for (int x = 0; x < width / factor + 1; ++x) {
+				int xstart = x * factor;
+				int ystart = y * factor;
+				int xlim = MIN(xstart + factor, width);
+				int ylim = MIN(ystart + factor, height);
+
+				uint64_t total = 0;
+				for (int ry = ystart; ry < ylim; ++ry) {
+					for (int rx = xstart; rx < xlim; ++rx) {
+						total += data[(size_t)ry * width + rx];
+					}
+				}
+
+				uint16_t avg = total / (factor * factor);
+				for (int ry = ystart; ry < ylim; ++ry) {
+					for (int rx = xstart; rx < xlim; ++rx) {
+						data[(size_t)ry * width + rx] = avg;
+					}
+				}
+			}
+		}
+	}
+}
+
+static bool planar_scale(struct planar_image *img, double scale) {
+	struct planar_image res;
+	if (!planar_alloc(&res, img->width * scale, img->height * scale)) {
+		swaylock_log(LOG_ERROR, "Failed to allocate planes for scale effect");
+		return false;
+	}
+
+	for (int c = 0; c < 3; ++c) {
+		memset(res.planes[c], 0, (size_t)res.width * res.height * sizeof(uint16_t));
+	}
+
+	double fact = 1.0 / scale;
+#pragma omp parallel for
+	for (int dy = 0; dy < res.height; ++dy) {
+		int sy = dy * fact;
+		if (sy >= img->height) continue;
+		for (int c = 0; c < 3; ++c) {
+			uint16_t *srow = img->planes[c] + (size_t)sy * img->width;
+			uint16_t *drow = res.planes[c] + (size_t)dy * res.width;
+			for (int dx = 0; dx < res.width; ++dx) {
+				int sx = dx * fact;
+				if (sx >= img->width) continue;
+				drow[dx] = srow[sx];
+			}
+		}
+	}
+
+	planar_free(img);
+	*img = res;
+	return true;
+}
+
+static void planar_greyscale(struct planar_image *img) {
+	size_t len = (size_t)img->width * img->height;
+	uint16_t *r = img->planes[0], *g = img->planes[1], *b = img->planes[2];
+#pragma omp parallel for
+	for (size_t i = 0; i < len; ++i) {
+		float luma = 0.2989f * r[i] + 0.5870f * g[i] + 0.1140f * b[i];
+		if (luma > 65535) luma = 65535;
+		r[i] = g[i] = b[i] = luma + 0.5f;
+	}
+}
+
+static void planar_vignette(struct planar_image *img, double base, double factor) {
+	base = fmin(1, fmax(0, base));
+	factor = fmin(1 - base, fmax(0, factor));
+	int width = img->width, height = img->height;
+#pragma omp parallel for
+	for (int y = 0; y < height; ++y) {
+		double yf = (y * 1.0) / height;
+		for (int x = 0; x < width; ++x) {
+			double xf = (x * 1.0) / width;
+			float vignette_factor = base + factor
+				* 16 * xf * yf * (1.0 - xf) * (1.0 - yf);
+
+			size_t index = (size_t)y * width + x;
+			for (int c = 0; c < 3; ++c) {
+				img->planes[c][index] *= vignette_factor;
+			}
+		}
+	}
+}
+
+static bool run_effect_planar(struct planar_image *img, int scale,
+		struct swaylock_effect *effect) {
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+		return planar_blur(img, scale, effect->e.blur.radius, effect->e.blur.times);
+	case EFFECT_PIXELATE:
+		planar_pixelate(img, scale, effect->e.pixelate.factor);
+		return true;
+	case EFFECT_SCALE:
+		return planar_scale(img, effect->e.scale);
+	case EFFECT_GREYSCALE:
+		planar_greyscale(img);
+		return true;
+	case EFFECT_VIGNETTE:
+		planar_vignette(img, effect->e.vignette.base, effect->e.vignette.factor);
+		return true;
+	default:
+		abort();
+	}
+}
+
+// The tiled executor below cuts the frame into horizontal bands, and pushes
+// each band through a whole run of effects before moving on to the next one,
+// so that the intermediate results stay in cache instead of being streamed
+// through memory once per effect.
+// Only effects which look at a bounded number of neighbouring rows can be
+// run this way; anything else (scale, compose, custom) runs on the full frame.
+static bool effect_is_tileable(struct swaylock_effect *effect) {
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+	case EFFECT_PIXELATE:
+	case EFFECT_GREYSCALE:
+	case EFFECT_VIGNETTE:
+		return true;
+	case EFFECT_SCALE:
+	case EFFECT_COMPOSE:
+	case EFFECT_CUSTOM:
+		return false;
+	}
+
+	abort();
+}
+
+// The number of rows above and below a band which an effect has to see
+// to produce correct output for every row in the band.
+static int effect_halo(struct swaylock_effect *effect, int scale) {
+	switch (effect->tag) {
+	case EFFECT_BLUR:
+		return effect->e.blur.radius * scale * effect->e.blur.times;
+	case EFFECT_PIXELATE:
+		return effect->e.pixelate.factor * scale - 1;
+	default:
+		return 0;
+	}
+}
+
+// The number of full-frame passes the effect makes over the frame
+// when it's run on its own.
+static int effect_passes(struct swaylock_effect *effect) {
+	if (effect->tag == EFFECT_BLUR) {
+		return 2 * effect->e.blur.times;
+	}
+	return 1;
+}
+
+static size_t l2_cache_size(void) {
+	long size = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+	if (size <= 0) {
+		size = 1024 * 1024;
+	}
+	return size;
+}
+
+static void run_effect_band(uint32_t **data, uint32_t **tmp, uint32_t *scratch,
+		int width, int height, int yoff, int full_height, int scale,
+		struct swaylock_effect *effect) {
+	switch (effect->tag) {
+	case EFFECT_BLUR: {
+		uint32_t *res = effect_blur(*tmp, *data, scratch, width, height, scale,
+				effect->e.blur.radius, effect->e.blur.times);
+		if (res != *data) {
+			*tmp = *data;
+			*data = res;
+		}
+		break;
+	}
+
+	case EFFECT_PIXELATE:
+		effect_pixelate(*data, width, height, yoff, scale,
+				effect->e.pixelate.factor);
+		break;
+
+	case EFFECT_GREYSCALE:
+		effect_greyscale(*data, width, height);
+		break;
+
+	case EFFECT_VIGNETTE:
+		effect_vignette(*data, width, height, yoff, full_height,
+				effect->e.vignette.base, effect->e.vignette.factor);
+		break;
+
+	default:
+		abort();
+	}
+}
+
+// Runs 'count' tileable effects over the surface band by band, with bands
+// spread across threads. Returns NULL, leaving 'surface' untouched, if
+// tiling isn't worth it or fails; the caller should then run the effects
+// one at a time.
+static cairo_surface_t *run_effects_tiled(cairo_surface_t *surface, int scale,
+		struct swaylock_effect *effects, int count, int *nbands_out) {
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+
+	int halo = 0, passes = 0;
+	for (int i = 0; i < count; ++i) {
+		halo += effect_halo(&effects[i], scale);
+		passes += effect_passes(&effects[i]);
+	}
+
+	// Copying bands in and out of the scratch buffers costs two passes,
+	// so there's nothing to gain unless the effects themselves make more.
+	if (passes <= 2) {
+		return NULL;
+	}
+
+	// Each band needs two buffers to ping-pong between, plus the blur scratch.
+	size_t row_size = (size_t)width * sizeof(uint32_t);
+	int fit_rows = l2_cache_size() / (row_size * 3);
+	int rows = fit_rows - 2 * halo;
+	// If a band with its halo doesn't fit in L2 with rows to spare, or the
+	// recomputed halo rows would outnumber the rows we keep, tiling only
+	// adds work.
+	if (rows < 8 || rows < 2 * halo) {
+		return NULL;
+	}
+
+	int nbands = (height + rows - 1) / rows;
+	if (nbands < 2) {
+		return NULL;
+	}
+
+	cairo_surface_t *surf = create_effect_surface(width, height);
+	if (cairo_surface_status(surf) != CAIRO_STATUS_SUCCESS) {
+		swaylock_log(LOG_ERROR, "Failed to create surface for tiled effects");
+		cairo_surface_destroy(surf);
+		return NULL;
+	}
+
+	uint32_t *src = (uint32_t *)cairo_image_surface_get_data(surface);
+	uint32_t *dest = (uint32_t *)cairo_image_surface_get_data(surf);
+	size_t band_size = (size_t)(rows + 2 * halo) * width;
+	bool failed = false;
+
+#pragma omp parallel
+	{
+		// Allocated on a thread's first band, so that threads which
+		// don't get one don't pay for the buffers.
+		uint32_t *a = NULL, *b = NULL, *scratch = NULL;
+
+#pragma omp for schedule(dynamic)
+		for (int band = 0; band < nbands; ++band) {
+			bool band_failed;
+#pragma omp atomic read
+			band_failed = failed;
+			if (band_failed) {
+				continue;
+			}
+
+			if (a == NULL) {
+				a = malloc(band_size * sizeof(*a));
+				b = malloc(band_size * sizeof(*b));
+				scratch = malloc(band_size * sizeof(*scratch));
+				if (!a || !b || !scratch) {
+#pragma omp atomic write
+					failed = true;
+					continue;
+				}
+			}
+
+			int y0 = band * rows;
+			int y1 = MIN(y0 + rows, height);
+			int ey0 = y0 - halo < 0 ? 0 : y0 - halo;
+			int ey1 = MIN(y1 + halo, height);
+
+			uint32_t *data = a, *tmp = b;
+			memcpy(data, src + (size_t)ey0 * width, (ey1 - ey0) * row_size);
+			for (int i = 0; i < count; ++i) {
+				run_effect_band(&data, &tmp, scratch, width, ey1 - ey0,
+						ey0, height, scale, &effects[i]);
+			}
+			memcpy(dest + (size_t)y0 * width, data + (size_t)(y0 - ey0) * width,
+					(y1 - y0) * row_size);
+		}
+
+		free(a);
+		free(b);
+		free(scratch);
+	}
+
+	if (failed) {
+		swaylock_log(LOG_ERROR, "Failed to allocate buffers for tiled effects");
+		cairo_surface_destroy(surf);
+		return NULL;
+	}
+
+	cairo_surface_flush(surf);
+	cairo_surface_destroy(surface);
+	*nbands_out = nbands;
+	return surf;
+}
+
+static int tileable_run_length(struct swaylock_effect *effects, int count) {
+	int n = 0;
+	while (n < count && effect_is_tileable(&effects[n])) {
+		++n;
+	}
+	return n;
+}
+
+static int planar_run_length(struct swaylock_effect *effects, int count) {
+	int n = 0;
+	while (n < count && effect_is_planar(&effects[n])) {
+		++n;
+	}
+	return n;
+}
+
+// Runs 'count' planar-capable effects, converting to planes on the way in
+// and back to packed XRGB on the way out. Returns NULL, leaving 'surface'
+// untouched, if anything fails; the caller should then use the packed path.
+static cairo_surface_t *run_effects_planar(cairo_surface_t *surface, int scale,
 		struct swaylock_effect *effects, int count) {
-	surface = ensure_format(surface);
-	if (surface == NULL) return NULL;
+	struct planar_image img;
+	if (!planar_from_surface(&img, surface)) {
+		swaylock_log(LOG_ERROR, "Failed to allocate planes for effects");
+		return NULL;
+	}
 
 	for (int i = 0; i < count; ++i) {
-		struct swaylock_effect *effect = &effects[i];
-		surface = run_effect(surface, scale, effect);
+		if (!run_effect_planar(&img, scale, &effects[i])) {
+			planar_free(&img);
+			return NULL;
+		}
 	}
 
-	return surface;
+	cairo_surface_t *surf = planar_to_surface(&img);
+	planar_free(&img);
+	if (surf == NULL) {
+		return NULL;
+	}
+
+	cairo_surface_destroy(surface);
+	return surf;
 }
 
 #define TIME_MSEC(tv) ((tv).tv_sec * 1000.0 + (tv).tv_nsec / 1000000.0)
 #define TIME_DELTA(first, last) (TIME_MSEC(last) - TIME_MSEC(first))
 
+static void print_effects_time(struct swaylock_effect *effects, int count,
+		const char *how, struct timespec *start_tv) {
+	struct timespec end_tv;
+	clock_gettime(CLOCK_MONOTONIC, &end_tv);
+	fprintf(stderr, "    ");
+	for (int i = 0; i < count; ++i) {
+		fprintf(stderr, "%s%s", i == 0 ? "" : "+", effect_name(&effects[i]));
+	}
+	fprintf(stderr, "%s: %fms\n", how, TIME_DELTA(*start_tv, end_tv));
+}
+
+static cairo_surface_t *run_effects(cairo_surface_t *surface, int scale,
+		struct swaylock_effect *effects, int count, bool planar, bool timed) {
+	for (int i = 0; i < count;) {
+		struct timespec start_tv;
+		clock_gettime(CLOCK_MONOTONIC, &start_tv);
+
+		int n = planar ? planar_run_length(&effects[i], count - i) : 0;
+		if (n > 0) {
+			cairo_surface_t *surf = run_effects_planar(
+					surface, scale, &effects[i], n);
+			if (surf != NULL) {
+				surface = surf;
+				if (timed) {
+					print_effects_time(&effects[i], n, " (planar)", &start_tv);
+				}
+				i += n;
+				continue;
+			}
+		}
+
+		n = tileable_run_length(&effects[i], count - i);
+		if (n > 0) {
+			int nbands;
+			cairo_surface_t *surf = run_effects_tiled(
+					surface, scale, &effects[i], n, &nbands);
+			if (surf != NULL) {
+				surface = surf;
+				if (timed) {
+					char how[32];
+					snprintf(how, sizeof(how), " (tiled, %i bands)", nbands);
+					print_effects_time(&effects[i], n, how, &start_tv);
+				}
+				i += n;
+				continue;
+			}
+		}
+
+		for (int end = i + (n > 0 ? n : 1); i < end; ++i) {
+			clock_gettime(CLOCK_MONOTONIC, &start_tv);
+			surface = run_effect(surface, scale, &effects[i]);
+			if (timed) {
+				print_effects_time(&effects[i], 1, "", &start_tv);
+			}
+		}
+	}
+
+	return surface;
+}
+
+int swaylock_effects_downscale(struct swaylock_effect *effects, int count) {
+	// Repeated box blurs add up to about a gaussian blur
+	double variance = 0;
+	for (int i = 0; i < count; ++i) {
+		switch (effects[i].tag) {
+		case EFFECT_BLUR: {
+			double radius = effects[i].e.blur.radius;
+			variance += radius * radius * effects[i].e.blur.times / 3;
+			break;
+		}
+		case EFFECT_GREYSCALE:
+		case EFFECT_VIGNETTE:
+			break;
+		default:
+			// Anything else may add detail, or work in pixels
+			return 1;
+		}
+	}
+
+	// A blur whose standard deviation is three times the factor or more
+	// leaves nothing that the smaller image would lose
+	int factor = 1;
+	while (factor < 4 && sqrt(variance) >= 3 * factor * 2) {
+		factor *= 2;
+	}
+
+	if (factor > 1) {
+		for (int i = 0; i < count; ++i) {
+			if (effects[i].tag == EFFECT_BLUR) {
+				long radius = lround((double)effects[i].e.blur.radius / factor);
+				effects[i].e.blur.radius = radius > 1 ? radius : 1;
+			}
+		}
+	}
+	return factor;
+}
+
+cairo_surface_t *swaylock_effects_run(cairo_surface_t *surface, int scale,
+		struct swaylock_effect *effects, int count, bool planar) {
+	surface = ensure_format(surface);
+	if (surface == NULL) return NULL;
+
+	return run_effects(surface, scale, effects, count, planar, false);
+}
+
 cairo_surface_t *swaylock_effects_run_timed(cairo_surface_t *surface, int scale,
-		struct swaylock_effect *effects, int count) {
+		struct swaylock_effect *effects, int count, bool planar) {
 	struct timespec start_tv;
 	clock_gettime(CLOCK_MONOTONIC, &start_tv);
 
 	surface = ensure_format(surface);
 	if (surface == NULL) return NULL;
 
-	fprintf(stderr, "Running %i effects:\n", count);
-	for (int i = 0; i < count; ++i) {
-		struct timespec effect_start_tv;
-		clock_gettime(CLOCK_MONOTONIC, &effect_start_tv);
-
-		struct swaylock_effect *effect = &effects[i];
-		surface = run_effect(surface, scale, effect);
-
-		struct timespec effect_end_tv;
-		clock_gettime(CLOCK_MONOTONIC, &effect_end_tv);
-		fprintf(stderr, "    %s: %fms\n", effect_name(effect),
-				TIME_DELTA(effect_start_tv, effect_end_tv));
+	// Run the packed path on a copy first, so the two can be compared.
+	if (planar) {
+		int width = cairo_image_surface_get_width(surface);
+		int height = cairo_image_surface_get_height(surface);
+		cairo_surface_t *copy = cairo_image_surface_create(
+				CAIRO_FORMAT_RGB24, width, height);
+		if (cairo_surface_status(copy) == CAIRO_STATUS_SUCCESS) {
+			memcpy(cairo_image_surface_get_data(copy),
+					cairo_image_surface_get_data(surface),
+					(size_t)width * height * sizeof(uint32_t));
+			cairo_surface_mark_dirty(copy);
+
+			fprintf(stderr, "Running %i effects (packed, for comparison):\n", count);
+			copy = run_effects(copy, scale, effects, count, false, true);
+
+			struct timespec end_tv;
+			clock_gettime(CLOCK_MONOTONIC, &end_tv);
+			fprintf(stderr, "Packed effects took %fms.\n", TIME_DELTA(start_tv, end_tv));
+			clock_gettime(CLOCK_MONOTONIC, &start_tv);
+		}
+		cairo_surface_destroy(copy);
 	}
 
+	fprintf(stderr, "Running %i effects%s:\n", count, planar ? " (planar)" : "");
+	surface = run_effects(surface, scale, effects, count, planar, true);
+
 	struct timespec end_tv;
 	clock_gettime(CLOCK_MONOTONIC, &end_tv);
 	fprintf(stderr, "Effects took %fms.\n", TIME_DELTA(start_tv, end_tv));
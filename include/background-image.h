@@ -1,5 +1,6 @@
 #ifndef _SWAY_BACKGROUND_IMAGE_H
 #define _SWAY_BACKGROUND_IMAGE_H
+#include <stdbool.h>
 #include <wayland-client.h>
 #include "cairo.h"
 
@@ -15,11 +16,52 @@ enum background_mode {
 
 struct swaylock_surface;
 
+// An image rendered for a buffer, so that redraws are a copy. It only
+// covers the part of the buffer the image is drawn to, at x, y.
+struct prescaled_image {
+	cairo_surface_t *source; // What it was rendered from, referenced
+	cairo_surface_t *image;
+	int width, height; // of the buffer
+	int align;
+	int x, y;
+};
+
 enum background_mode parse_background_mode(const char *mode);
-cairo_surface_t *load_background_image(const char *path);
+// Loads an image which is rendered into buffers of (at most) width x height
+// with the given mode. Decoders that can will shrink it to about that size.
+cairo_surface_t *load_background_image(const char *path,
+		int width, int height, enum background_mode mode);
+// Stores an image in the raw format, which load_background_image can map
+// without decoding it. The tag, if not NULL, is stored along with it.
+bool write_raw_image(cairo_surface_t *image, const char *tag,
+		const char *path);
+// Maps a raw image. Returns NULL if the file isn't one, or if 'tag' isn't
+// NULL and the image wasn't stored with exactly that tag.
+cairo_surface_t *load_raw_image(const char *path, const char *tag);
 cairo_surface_t *load_background_from_buffer(void *buf, uint32_t format,
 		uint32_t width, uint32_t height, uint32_t stride, enum wl_output_transform transform);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height, double alpha);
+// Packs an image into RGB565 pixels at dest, with ordered dithering so
+// that gradients don't band. Alpha is dropped.
+void pack_rgb565(void *dest, int dest_stride, cairo_surface_t *image);
+// Shrinks an image by a power of two factor, box filtering it. Takes over
+// the reference to image.
+cairo_surface_t *downscale_background_image(cairo_surface_t *image,
+		int factor);
+// Renders an image as render_background_image would, into a new surface
+// covering just the part of the buffer the image is drawn to, which starts
+// at x, y and is aligned to multiples of align. Large reductions go through
+// a mip pyramid first. An image which already has the buffer's size is
+// returned as it is, with a new reference.
+cairo_surface_t *prescale_background_image(cairo_surface_t *image,
+		enum background_mode mode, int buffer_width, int buffer_height,
+		int align, int *x, int *y);
+// Returns the prescaled image, only rendering it again when the image or
+// the buffer size changed.
+cairo_surface_t *prescaled_image_get(struct prescaled_image *prescaled,
+		cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height, int align);
+void prescaled_image_finish(struct prescaled_image *prescaled);
 
 #endif
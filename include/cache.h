@@ -0,0 +1,27 @@
+#ifndef _SWAYLOCK_CACHE_H
+#define _SWAYLOCK_CACHE_H
+
+#include <stdbool.h>
+#include "background-image.h"
+#include "cairo.h"
+#include "effects.h"
+
+// Returns $XDG_CACHE_HOME/swaylock (or ~/.cache/swaylock), creating it if
+// needed. Returns NULL if there is no usable cache directory.
+const char *swaylock_cache_dir(void);
+
+// Describes everything a processed background depends on: the image file,
+// the size it's loaded for and the effects. Returns NULL if the image can't
+// be cached. The caller frees the key.
+char *background_cache_key(const char *path, int width, int height,
+		enum background_mode mode, struct swaylock_effect *effects, int count,
+		bool planar, int downscale);
+
+// Maps the cached background for the key, or returns NULL on a miss.
+cairo_surface_t *background_cache_load(const char *key);
+
+// Stores a processed background, evicting the least recently used ones
+// if the cache grew too large.
+void background_cache_store(const char *key, cairo_surface_t *image);
+
+#endif
@@ -14,6 +14,19 @@ cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel)
 
 cairo_surface_t *cairo_surface_duplicate(cairo_surface_t *src);
 
+// Creates another image surface over the pixels of an image surface which
+// is no longer drawn to. cairo surfaces, even as sources, can't be used by
+// several threads at once, but aliases of the same pixels can. The alias
+// mustn't outlive the image.
+cairo_surface_t *cairo_image_surface_alias(cairo_surface_t *image);
+
+// Calls paint for a few stripes of rows of an image surface in parallel,
+// each with a cairo context of its own in the coordinates of the whole
+// surface. Small surfaces are painted in one go. Sources have to be used
+// through an alias.
+void cairo_image_surface_paint_striped(cairo_surface_t *surface,
+		void (*paint)(cairo_t *cairo, void *data), void *data);
+
 #if HAVE_GDK_PIXBUF
 
 cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(
@@ -55,10 +55,20 @@ struct swaylock_effect {
 	} tag;
 };
 
+// Strong blurs leave nothing that a full resolution image would add, so the
+// effects can run on an image scaled down by the returned factor (1, 2 or
+// 4). The blur radii are divided by it to match.
+int swaylock_effects_downscale(struct swaylock_effect *effects, int count);
+
+struct shm_allocator;
+
+// Makes effects allocate the surfaces they write into from shared memory.
+void swaylock_effects_set_allocator(struct shm_allocator *shm);
+
 cairo_surface_t *swaylock_effects_run(cairo_surface_t *surface, int scale,
-		struct swaylock_effect *effects, int count);
+		struct swaylock_effect *effects, int count, bool planar);
 
 cairo_surface_t *swaylock_effects_run_timed(cairo_surface_t *surface, int scale,
-		struct swaylock_effect *effects, int count);
+		struct swaylock_effect *effects, int count, bool planar);
 
 #endif
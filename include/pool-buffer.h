@@ -4,21 +4,25 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
+#include "shm-allocator.h"
 
 struct pool_buffer {
+	struct shm_allocator *shm;
 	struct wl_buffer *buffer;
 	cairo_surface_t *surface;
 	cairo_t *cairo;
 	uint32_t width, height;
+	uint32_t format;
 	void *data;
 	size_t size;
 	bool busy;
 };
 
-struct pool_buffer *create_buffer(struct wl_shm *shm, struct pool_buffer *buf,
+struct pool_buffer *create_buffer(struct shm_allocator *shm, struct pool_buffer *buf,
 	int32_t width, int32_t height, uint32_t format);
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-	struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
+struct pool_buffer *get_next_buffer(struct shm_allocator *shm,
+	struct pool_buffer pool[static 2], uint32_t width, uint32_t height,
+	uint32_t format);
 void destroy_buffer(struct pool_buffer *buffer);
 
 #endif
@@ -0,0 +1,40 @@
+#ifndef _SWAYLOCK_SHM_ALLOCATOR_H
+#define _SWAYLOCK_SHM_ALLOCATOR_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+#include "cairo.h"
+
+// Hands out wl_buffers carved from a few large, sealed memfd pools, which
+// grow as needed instead of each buffer getting a pool of its own.
+struct shm_allocator;
+
+struct shm_allocator *shm_allocator_create(struct wl_shm *shm);
+
+// Creates a buffer and maps its pixels at *data, prefaulted. The memory
+// stays valid after the wl_buffer is destroyed, until shm_free.
+struct wl_buffer *shm_create_buffer(struct shm_allocator *alloc,
+		int32_t width, int32_t height, int32_t stride, uint32_t format,
+		void **data);
+
+// Returns the memory of a buffer to its pool. Safe to call from any thread.
+void shm_free(struct shm_allocator *alloc, void *data);
+
+// Wraps memory from shm_create_buffer in a cairo image surface, which
+// frees it when destroyed.
+cairo_surface_t *shm_image_wrap(struct shm_allocator *alloc, void *data,
+		cairo_format_t format, int width, int height, int stride);
+
+// Creates a cairo image surface in shared memory, so that it can be shown
+// without a copy. Unlike cairo_image_surface_create, the pixels may hold
+// whatever a freed buffer left there. Safe to call from any thread.
+// Returns NULL on failure.
+cairo_surface_t *shm_image_create(struct shm_allocator *alloc,
+		cairo_format_t format, int width, int height);
+
+// Returns a wl_buffer for the pixels of an image from shm_image_create or
+// shm_image_wrap, created on first use and destroyed with the image.
+// Returns NULL for any other image.
+struct wl_buffer *shm_image_get_buffer(cairo_surface_t *image);
+
+#endif
@@ -1,5 +1,6 @@
 #ifndef _SWAYLOCK_H
 #define _SWAYLOCK_H
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
@@ -77,6 +78,8 @@ struct swaylock_args {
 	struct swaylock_effect *effects;
 	int effects_count;
 	bool time_effects;
+	bool planar_effects;
+	uint32_t background_format; // wl_shm format, or 0 to pick one
 	bool indicator;
 	bool clock;
 	char *timestr;
@@ -105,9 +108,18 @@ struct swaylock_state {
 	struct wl_subcompositor *subcompositor;
 	struct zwlr_screencopy_manager_v1 *screencopy_manager;
 	struct wl_shm *shm;
+	struct shm_allocator *shm_allocator;
+	bool shm_rgb565; // whether wl_shm supports WL_SHM_FORMAT_RGB565
+	// Optional; without them, backgrounds are always full size buffers
+	struct wp_viewporter *viewporter;
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 	struct wl_list surfaces;
 	struct wl_list images;
 	struct swaylock_args args;
+	// Backgrounds with effects are this much smaller than the outputs
+	int effects_downscale;
+	size_t frame_copies_saved; // backgrounds shown without painting them
 	struct swaylock_password password;
 	struct swaylock_xkb xkb;
 	cairo_surface_t *test_surface;
@@ -126,12 +138,32 @@ struct swaylock_state {
 
 struct swaylock_surface {
 	cairo_surface_t *image;
+	// Buffer transform to present 'image' with
+	enum wl_output_transform image_transform;
 	struct {
+		// The shm buffers the compositor offered for the frame
+		struct {
+			uint32_t format, width, height, stride;
+		} offers[4];
+		int n_offers;
 		uint32_t format, width, height, stride;
 		enum wl_output_transform transform;
+		struct wl_buffer *buffer;
 		void *data;
 		cairo_surface_t *original_image;
 		struct swaylock_image *image;
+		// Converts the screenshot and runs the effects on it,
+		// while the other outputs are still being captured
+		pthread_t worker;
+		int threads;
+		bool needed, worker_started, apply_effects, failed;
+		// The orientation the processed screenshot was left in
+		enum wl_output_transform image_transform;
+		// Ready screenshots wait for a worker until they've been compared
+		// with those of other outputs; mirrored outputs share the first one
+		uint64_t fingerprint;
+		bool ready, fingerprinted;
+		struct swaylock_surface *source;
 	} screencopy;
 	struct swaylock_state *state;
 	struct wl_output *output;
@@ -139,21 +171,56 @@ struct swaylock_surface {
 	struct wl_surface *surface; // surface for background
 	struct wl_surface *child; // indicator surface made into subsurface
 	struct wl_subsurface *subsurface;
+	// When the background is a single pixel scaled up to the output,
+	// a center or fit image goes on a subsurface below the indicator
+	struct wl_surface *image_child;
+	struct wl_subsurface *image_subsurface;
+	struct wp_viewport *viewport;
+	struct wp_viewport *child_viewport;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct wl_buffer *solid_buffer;
 	struct zwlr_screencopy_frame_v1 *screencopy_frame;
 	struct ext_session_lock_surface_v1 *ext_session_lock_surface_v1;
+	struct pool_buffer background_buffers[2];
+	struct pool_buffer image_buffers[2];
 	struct pool_buffer indicator_buffers[2];
 	struct swaylock_fade fade;
 	int events_pending;
 	bool configured;
+	// Whether the output has sent done, i.e. told us its name and mode
+	bool described;
+	bool prepared; // see prepare_surface
+	// Paints the background ahead of the first configure
+	struct {
+		pthread_t worker;
+		int threads;
+		bool started;
+	} prerender;
+	int32_t mode_width, mode_height;
 	bool frame_pending, dirty;
 	uint32_t width, height;
 	int32_t scale;
+	// The scale the compositor would like the surface drawn at, in 120ths,
+	// or 0 if it doesn't say
+	uint32_t preferred_scale;
 	enum wl_output_subpixel subpixel;
 	enum wl_output_transform transform;
 	char *output_name;
 	struct wl_list link;
 	// Dimensions of last wl_buffer committed to background surface
 	int last_buffer_width, last_buffer_height;
+	// The fade alpha of the last background buffer
+	double last_buffer_alpha;
+	bool background_dirty; // no free buffer at the last background render
+	// A background buffer painted ahead of the first configure, and what
+	// it was painted for; see prerender_frame_background
+	struct {
+		struct pool_buffer *buffer;
+		uint32_t width, height, format;
+		cairo_surface_t *image;
+	} prerendered;
+	// image and screencopy.original_image prescaled for the buffer
+	struct prescaled_image background, original_background;
 };
 
 // There is exactly one swaylock_image for each -i argument
@@ -162,6 +229,17 @@ struct swaylock_image {
 	char *output_name;
 	cairo_surface_t *cairo_surface;
 	struct wl_list link;
+	// Decoded, with the effects applied, in the background once an output
+	// that shows the image is connected
+	struct swaylock_state *state;
+	pthread_t loader;
+	int threads;
+	bool requested, loading;
+	// The buffer size it's loaded for, decoders may shrink it to that
+	int load_width, load_height;
+	// Loaded again at a larger size, by 'loader', while locked
+	bool reloading;
+	cairo_surface_t *reloaded;
 };
 
 void swaylock_handle_key(struct swaylock_state *state,
@@ -169,6 +247,11 @@ void swaylock_handle_key(struct swaylock_state *state,
 void swaylock_handle_mouse(struct swaylock_state *state);
 void swaylock_handle_touch(struct swaylock_state *state);
 void render_frame_background(struct swaylock_surface *surface, bool commit);
+// Paints the background for a surface of the given size into a buffer,
+// which render_frame_background then only has to attach if the surface is
+// configured with that size.
+void prerender_frame_background(struct swaylock_surface *surface,
+		uint32_t width, uint32_t height);
 void render_background_fade(struct swaylock_surface *surface, uint32_t time);
 void render_frame(struct swaylock_surface *surface);
 void damage_surface(struct swaylock_surface *surface);
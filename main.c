@@ -4,19 +4,22 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <omp.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wordexp.h>
 #include "background-image.h"
+#include "cache.h"
 #include "cairo.h"
 #include "comm.h"
 #include "log.h"
@@ -24,9 +27,17 @@
 #include "password-buffer.h"
 #include "pool-buffer.h"
 #include "seat.h"
+#include "shm-allocator.h"
 #include "swaylock.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "ext-session-lock-v1-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
 
 // returns a positive integer in milliseconds
 static uint32_t parse_seconds(const char *seconds) {
@@ -239,9 +250,46 @@ static void daemonize_done(void *fdptr) {
 	*fd = -1;
 }
 
+static void share_screenshot(struct swaylock_surface *surface);
+
 static void destroy_surface(struct swaylock_surface *surface) {
 	swaylock_log(LOG_DEBUG, "Destroy surface for output %s", surface->output_name);
 
+	// The output may go away while its screenshot is still being processed
+	if (surface->screencopy.worker_started) {
+		pthread_join(surface->screencopy.worker, NULL);
+		surface->screencopy.worker_started = false;
+	}
+	struct swaylock_surface *other;
+	if (surface->screencopy.ready) {
+		// The screenshot wasn't processed yet; the first output mirroring
+		// this one takes over the pixels, and becomes the source for the rest
+		struct swaylock_surface *heir = NULL;
+		wl_list_for_each(other, &surface->state->surfaces, link) {
+			if (other->screencopy.source != surface) {
+				continue;
+			}
+			if (heir == NULL) {
+				heir = other;
+				heir->screencopy.source = NULL;
+				heir->screencopy.data = surface->screencopy.data;
+				heir->screencopy.ready = true;
+			} else {
+				other->screencopy.source = heir;
+			}
+		}
+		if (heir == NULL) {
+			shm_free(surface->state->shm_allocator, surface->screencopy.data);
+		}
+		surface->screencopy.data = NULL;
+		surface->screencopy.ready = false;
+	}
+	wl_list_for_each(other, &surface->state->surfaces, link) {
+		if (other->screencopy.source == surface) {
+			share_screenshot(other);
+		}
+	}
+
 	wl_list_remove(&surface->link);
 	if (surface->ext_session_lock_surface_v1 != NULL) {
 		ext_session_lock_surface_v1_destroy(surface->ext_session_lock_surface_v1);
@@ -252,17 +300,45 @@ static void destroy_surface(struct swaylock_surface *surface) {
 	if (surface->child) {
 		wl_surface_destroy(surface->child);
 	}
+	if (surface->image_subsurface) {
+		wl_subsurface_destroy(surface->image_subsurface);
+	}
+	if (surface->image_child) {
+		wl_surface_destroy(surface->image_child);
+	}
+	if (surface->viewport) {
+		wp_viewport_destroy(surface->viewport);
+	}
+	if (surface->child_viewport) {
+		wp_viewport_destroy(surface->child_viewport);
+	}
+	if (surface->fractional_scale) {
+		wp_fractional_scale_v1_destroy(surface->fractional_scale);
+	}
 	if (surface->surface != NULL) {
 		wl_surface_destroy(surface->surface);
 	}
+	if (surface->solid_buffer) {
+		wl_buffer_destroy(surface->solid_buffer);
+	}
+	destroy_buffer(&surface->background_buffers[0]);
+	destroy_buffer(&surface->background_buffers[1]);
+	destroy_buffer(&surface->image_buffers[0]);
+	destroy_buffer(&surface->image_buffers[1]);
 	destroy_buffer(&surface->indicator_buffers[0]);
 	destroy_buffer(&surface->indicator_buffers[1]);
+	prescaled_image_finish(&surface->background);
+	prescaled_image_finish(&surface->original_background);
 	wl_output_release(surface->output);
 	free(surface);
 }
 
 static const struct ext_session_lock_surface_v1_listener ext_session_lock_surface_v1_listener;
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener;
 
+static struct swaylock_image *find_image(struct swaylock_state *state,
+		const char *output_name);
+static void request_images(struct swaylock_state *state);
 static cairo_surface_t *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface);
 
@@ -276,7 +352,26 @@ static bool surface_is_opaque(struct swaylock_surface *surface) {
 	return (surface->state->args.colors.background & 0xff) == 0xff;
 }
 
-static void create_surface(struct swaylock_surface *surface) {
+// The size a lock surface for the output will most likely be configured
+// with, going by its current mode. Returns false if that isn't known yet.
+static bool expected_surface_size(struct swaylock_surface *surface,
+		uint32_t *width, uint32_t *height) {
+	if (surface->mode_width <= 0 || surface->mode_height <= 0 ||
+			surface->scale <= 0) {
+		return false;
+	}
+	if (surface->transform & WL_OUTPUT_TRANSFORM_90) {
+		*width = surface->mode_height / surface->scale;
+		*height = surface->mode_width / surface->scale;
+	} else {
+		*width = surface->mode_width / surface->scale;
+		*height = surface->mode_height / surface->scale;
+	}
+	return true;
+}
+
+// Picks the output's image, and how it's faded in and presented.
+static void select_surface_image(struct swaylock_surface *surface) {
 	swaylock_trace();
 	struct swaylock_state *state = surface->state;
 
@@ -286,6 +381,83 @@ static void create_surface(struct swaylock_surface *surface) {
 
 	surface->image = select_image(state, surface);
 
+	// A screenshot kept in capture orientation is presented with a buffer
+	// transform, which only works if it's this output's own screenshot.
+	surface->image_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	if (surface->screencopy.image_transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		if (surface->screencopy.image &&
+				surface->image == surface->screencopy.image->cairo_surface) {
+			surface->image_transform = surface->screencopy.image_transform;
+		} else {
+			swaylock_log(LOG_DEBUG, "Output %s doesn't show its own screenshot, "
+					"not fading from it", surface->output_name);
+			surface->fade.target_time = 0;
+		}
+	}
+}
+
+// Paints the output's background at the size the lock surface is expected
+// to get, so that the configure only has to attach it. With fractional
+// scaling, the buffer size depends on the scale the compositor prefers for
+// the lock surface, which isn't known until it exists, so nothing is painted.
+static void prerender_surface(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	bool fractional = state->fractional_scale_manager && state->viewporter;
+	uint32_t width, height;
+	if (!fractional && expected_surface_size(surface, &width, &height)) {
+		prerender_frame_background(surface, width, height);
+		swaylock_log(LOG_DEBUG, "Prerendered background of output %s for %ux%u",
+				surface->output_name, width, height);
+	}
+	surface->prepared = true;
+}
+
+static void prepare_surface(struct swaylock_surface *surface) {
+	select_surface_image(surface);
+	prerender_surface(surface);
+}
+
+static void *prerender_worker(void *data) {
+	struct swaylock_surface *surface = data;
+	omp_set_num_threads(surface->prerender.threads);
+	prerender_surface(surface);
+	return NULL;
+}
+
+// Prerenders the backgrounds of all outputs at once, each on a thread of its
+// own which splits it up further.
+static void prerender_surfaces(struct swaylock_state *state) {
+	int n_outputs = wl_list_length(&state->surfaces);
+	int n_threads = omp_get_num_procs() / (n_outputs > 0 ? n_outputs : 1);
+
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		surface->prerender.threads = n_threads > 0 ? n_threads : 1;
+		surface->prerender.started = pthread_create(&surface->prerender.worker,
+				NULL, prerender_worker, surface) == 0;
+		if (!surface->prerender.started) {
+			swaylock_log(LOG_ERROR, "Failed to start rendering the background "
+					"of output %s", surface->output_name);
+			prerender_surface(surface);
+		}
+	}
+
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->prerender.started) {
+			pthread_join(surface->prerender.worker, NULL);
+			surface->prerender.started = false;
+		}
+	}
+}
+
+static void create_surface(struct swaylock_surface *surface) {
+	swaylock_trace();
+	struct swaylock_state *state = surface->state;
+
+	if (!surface->prepared) {
+		prepare_surface(surface);
+	}
+
 	surface->surface = wl_compositor_create_surface(state->compositor);
 	assert(surface->surface);
 
@@ -295,6 +467,14 @@ static void create_surface(struct swaylock_surface *surface) {
 	assert(surface->subsurface);
 	wl_subsurface_set_sync(surface->subsurface);
 
+	// Fractional scales are applied through viewports
+	if (state->fractional_scale_manager && state->viewporter) {
+		surface->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+			state->fractional_scale_manager, surface->surface);
+		wp_fractional_scale_v1_add_listener(surface->fractional_scale,
+			&fractional_scale_listener, surface);
+	}
+
 	surface->ext_session_lock_surface_v1 = ext_session_lock_v1_get_lock_surface(
 		state->ext_session_lock_v1, surface->surface, surface->output);
 	ext_session_lock_surface_v1_add_listener(surface->ext_session_lock_surface_v1,
@@ -316,6 +496,9 @@ static void ext_session_lock_surface_v1_handle_configure(void *data,
 		uint32_t width, uint32_t height) {
 	swaylock_trace();
 	struct swaylock_surface *surface = data;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	surface->width = width;
 	surface->height = height;
 	// Render before we send the ACK event, so that we minimize flickering
@@ -323,6 +506,14 @@ static void ext_session_lock_surface_v1_handle_configure(void *data,
 	// to send the ACK first and then commit.
 	render_frame_background(surface, false);
 	ext_session_lock_surface_v1_ack_configure(lock_surface, serial);
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	swaylock_log(LOG_DEBUG, "Output %s configured to %ux%u, acked after %.3fms",
+			surface->output_name, width, height,
+			(end.tv_sec - start.tv_sec) * 1000.0 +
+			(end.tv_nsec - start.tv_nsec) / 1000000.0);
+
 	wl_surface_commit(surface->surface);
 	render_frame(surface);
 }
@@ -331,6 +522,26 @@ static const struct ext_session_lock_surface_v1_listener ext_session_lock_surfac
 	.configure = ext_session_lock_surface_v1_handle_configure,
 };
 
+static void handle_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale) {
+	swaylock_trace();
+	struct swaylock_surface *surface = data;
+	if (surface->preferred_scale == scale) {
+		return;
+	}
+	swaylock_log(LOG_DEBUG, "Output %s prefers scale %.3f",
+			surface->output_name, scale / 120.0);
+	surface->preferred_scale = scale;
+	if (surface->width > 0 && surface->height > 0) {
+		render_frame_background(surface, true);
+		damage_surface(surface);
+	}
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = handle_preferred_scale,
+};
+
 static const struct wl_callback_listener surface_frame_listener;
 
 static void surface_frame_handle_done(void *data, struct wl_callback *callback,
@@ -351,6 +562,9 @@ static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 			render_background_fade(surface, time);
 			surface->dirty = true;
 		}
+		if (surface->background_dirty) {
+			render_frame_background(surface, true);
+		}
 
 		render_frame(surface);
 	}
@@ -399,7 +613,11 @@ static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 
 static void handle_wl_output_mode(void *data, struct wl_output *output,
 		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+	struct swaylock_surface *surface = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		surface->mode_width = width;
+		surface->mode_height = height;
+	}
 }
 
 static void handle_wl_output_scale(void *data, struct wl_output *output,
@@ -412,75 +630,83 @@ static void handle_wl_output_scale(void *data, struct wl_output *output,
 	}
 }
 
-static struct wl_buffer *create_shm_buffer(struct wl_shm *shm, enum wl_shm_format fmt,
-		int width, int height, int stride, void **data_out) {
-	int size = stride * height;
-
-	const char shm_name[] = "/swaylock-shm";
-	int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-	if (fd < 0) {
-		fprintf(stderr, "shm_open failed\n");
-		return NULL;
-	}
-	shm_unlink(shm_name);
-
-	int ret;
-	while ((ret = ftruncate(fd, size)) == EINTR) {
-		// No-op
-	}
-	if (ret < 0) {
-		close(fd);
-		fprintf(stderr, "ftruncate failed\n");
-		return NULL;
-	}
-
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		fprintf(stderr, "mmap failed: %m\n");
-		close(fd);
-		return NULL;
-	}
-
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	close(fd);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-		stride, fmt);
-	wl_shm_pool_destroy(pool);
-
-	*data_out = data;
-	return buffer;
-}
-
 static cairo_surface_t *apply_effects(cairo_surface_t *image, struct swaylock_state *state, int scale) {
 	if (state->args.effects_count == 0) {
 		return image;
 	}
 
+	image = downscale_background_image(image, state->effects_downscale);
+
 	if (state->args.time_effects) {
 		return swaylock_effects_run_timed(
 				image, scale,
-				state->args.effects, state->args.effects_count);
+				state->args.effects, state->args.effects_count,
+				state->args.planar_effects);
 	} else {
 		return swaylock_effects_run(
 				image, scale,
-				state->args.effects, state->args.effects_count);
+				state->args.effects, state->args.effects_count,
+				state->args.planar_effects);
 	}
 }
 
-static void handle_screencopy_frame_buffer(void *data,
-		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
-		uint32_t height, uint32_t stride) {
-	swaylock_trace();
-	struct swaylock_surface *surface = data;
+// Gives up on a frame that was never copied. The compositor won't send
+// ready or failed for it, so nothing else would stop waiting for it.
+static void screencopy_frame_abort(struct swaylock_surface *surface,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	surface->screencopy.failed = true;
+	zwlr_screencopy_frame_v1_destroy(frame);
+	if (surface->screencopy_frame == frame) {
+		surface->screencopy_frame = NULL;
+	}
+	--surface->events_pending;
+}
+
+// Allocates a buffer for the chosen offer, and asks for the frame to be
+// copied into it.
+static void screencopy_frame_copy(struct swaylock_surface *surface,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	if (surface->screencopy.n_offers == 0) {
+		swaylock_log(LOG_ERROR, "Compositor offered no shm buffer for output %s",
+				surface->output_name);
+		screencopy_frame_abort(surface, frame);
+		return;
+	}
+
+	// Prefer the format our effects work in natively, which needs no
+	// conversion and can be used in place; see wrap_screencopy_buffer.
+	int test = 1;
+	bool is_little_endian = *(char *)&test == 1;
+	int chosen = 0;
+	for (int i = 0; i < surface->screencopy.n_offers; ++i) {
+		uint32_t format = surface->screencopy.offers[i].format;
+		if (is_little_endian && (format == WL_SHM_FORMAT_XRGB8888 ||
+				format == WL_SHM_FORMAT_ARGB8888)) {
+			chosen = i;
+			break;
+		}
+	}
+
+	uint32_t format = surface->screencopy.offers[chosen].format;
+	uint32_t width = surface->screencopy.offers[chosen].width;
+	uint32_t height = surface->screencopy.offers[chosen].height;
+	uint32_t stride = surface->screencopy.offers[chosen].stride;
+	swaylock_log(LOG_DEBUG, "Capturing output %s with shm format %#x "
+			"(%d offered)", surface->output_name, format,
+			surface->screencopy.n_offers);
 
 	struct swaylock_image *image = calloc(1, sizeof(struct swaylock_image));
 	image->path = NULL;
 	image->output_name = surface->output_name;
 
 	void *bufdata;
-	struct wl_buffer *buf = create_shm_buffer(surface->state->shm, format, width, height, stride, &bufdata);
+	struct wl_buffer *buf = shm_create_buffer(surface->state->shm_allocator,
+			width, height, stride, format, &bufdata);
 	if (buf == NULL) {
+		swaylock_log(LOG_ERROR, "Failed to allocate a buffer to capture "
+				"output %s", surface->output_name);
 		free(image);
+		screencopy_frame_abort(surface, frame);
 		return;
 	}
 
@@ -490,11 +716,53 @@ static void handle_screencopy_frame_buffer(void *data,
 	surface->screencopy.stride = stride;
 
 	surface->screencopy.image = image;
+	surface->screencopy.buffer = buf;
 	surface->screencopy.data = bufdata;
 
 	zwlr_screencopy_frame_v1_copy(frame, buf);
 }
 
+static void handle_screencopy_frame_buffer(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
+		uint32_t height, uint32_t stride) {
+	swaylock_trace();
+	struct swaylock_surface *surface = data;
+
+	int n = surface->screencopy.n_offers;
+	if (n < (int)(sizeof(surface->screencopy.offers) / sizeof(surface->screencopy.offers[0]))) {
+		surface->screencopy.offers[n].format = format;
+		surface->screencopy.offers[n].width = width;
+		surface->screencopy.offers[n].height = height;
+		surface->screencopy.offers[n].stride = stride;
+		surface->screencopy.n_offers = n + 1;
+	}
+
+	// Before version 3, there's only ever this one offer,
+	// and no buffer_done to wait for.
+	if (zwlr_screencopy_frame_v1_get_version(frame) < 3) {
+		screencopy_frame_copy(surface, frame);
+	}
+}
+
+static void handle_screencopy_frame_damage(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height) {
+	// We only use copy, not copy_with_damage
+}
+
+static void handle_screencopy_frame_linux_dmabuf(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+		uint32_t width, uint32_t height) {
+	// We'd have to map a dmabuf to read it; stick to shm buffers
+}
+
+static void handle_screencopy_frame_buffer_done(void *data,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	swaylock_trace();
+	struct swaylock_surface *surface = data;
+	screencopy_frame_copy(surface, frame);
+}
+
 static void handle_screencopy_frame_flags(void *data,
 		struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
 	swaylock_trace();
@@ -542,32 +810,246 @@ static void handle_screencopy_frame_flags(void *data,
 	}
 }
 
-static void handle_screencopy_frame_ready(void *data,
-		struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
-		uint32_t tv_sec_lo, uint32_t tv_nsec) {
-	swaylock_trace();
+// If the screenshot already is in cairo's RGB24 layout, the effects can run
+// directly on the mapped shm buffer instead of a converted copy.
+static cairo_surface_t *wrap_screencopy_buffer(struct swaylock_surface *surface,
+		enum wl_output_transform transform) {
+	int test = 1;
+	bool is_little_endian = *(char *)&test == 1;
+	if (!is_little_endian ||
+			transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+			(surface->screencopy.format != WL_SHM_FORMAT_XRGB8888 &&
+			 surface->screencopy.format != WL_SHM_FORMAT_ARGB8888) ||
+			(int)surface->screencopy.stride != cairo_format_stride_for_width(
+				CAIRO_FORMAT_RGB24, surface->screencopy.width)) {
+		return NULL;
+	}
+
+	return shm_image_wrap(surface->state->shm_allocator,
+			surface->screencopy.data, CAIRO_FORMAT_RGB24,
+			surface->screencopy.width, surface->screencopy.height,
+			surface->screencopy.stride);
+}
+
+// Whether the effects give the same result in any orientation, so that they
+// can run on a screenshot in capture orientation. Results may be off by a
+// pixel: blur's window and vignette's gradient aren't quite symmetric, so
+// with flipped transforms they come out shifted by one, which can't be seen.
+// Compose places an image by gravity, and custom effects can do anything.
+// Pixelate's grid starts at the top left corner, so its partial edge cells
+// would end up on other sides, by up to a whole cell.
+static bool effects_are_orientation_independent(struct swaylock_state *state) {
+	for (int i = 0; i < state->args.effects_count; ++i) {
+		switch (state->args.effects[i].tag) {
+		case EFFECT_COMPOSE:
+		case EFFECT_CUSTOM:
+		case EFFECT_PIXELATE:
+			return false;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+static void *screenshot_worker(void *data) {
 	struct swaylock_surface *surface = data;
 	struct swaylock_state *state = surface->state;
 
-	cairo_surface_t *image = load_background_from_buffer(
-			surface->screencopy.data,
-			surface->screencopy.format,
-			surface->screencopy.width,
-			surface->screencopy.height,
-			surface->screencopy.stride,
-			surface->screencopy.transform);
+	omp_set_num_threads(surface->screencopy.threads);
+
+	// Rather than rotating the screenshot, keep it the way it was captured
+	// and have the compositor rotate it; see render_frame_background.
+	// When fading into a different image, the screenshot has to be upright.
+	enum wl_output_transform transform = surface->screencopy.transform;
+	bool keep_orientation = surface->screencopy.apply_effects &&
+		effects_are_orientation_independent(state);
+	if (keep_orientation) {
+		transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	}
+
+	size_t copied = 0;
+	cairo_surface_t *image = wrap_screencopy_buffer(surface, transform);
 	if (image == NULL) {
-		swaylock_log(LOG_ERROR, "Failed to create image from screenshot");
-		state->args.screenshots = false;
-		state->args.fade_in = 0; // Fade in is not possible without screenshot
-	} else  {
-		surface->screencopy.original_image = cairo_surface_duplicate(image);
-		surface->screencopy.image->cairo_surface = image;
-		if (state->args.screenshots) {
-			swaylock_log(LOG_DEBUG, "Loaded screenshot for output %s", surface->output_name);
-			wl_list_insert(&state->images, &surface->screencopy.image->link);
+		image = load_background_from_buffer(
+				surface->screencopy.data,
+				surface->screencopy.format,
+				surface->screencopy.width,
+				surface->screencopy.height,
+				surface->screencopy.stride,
+				transform);
+		shm_free(state->shm_allocator, surface->screencopy.data);
+		if (image != NULL) {
+			copied += (size_t)cairo_image_surface_get_stride(image) *
+				cairo_image_surface_get_height(image);
 		}
 	}
+	surface->screencopy.data = NULL;
+	if (image == NULL) {
+		surface->screencopy.failed = true;
+		return NULL;
+	}
+	if (keep_orientation) {
+		surface->screencopy.image_transform = surface->screencopy.transform;
+	}
+
+	// The original is only needed to fade from. Effects may modify the
+	// image in place, so it has to be copied unless there aren't any.
+	if (!surface->screencopy.apply_effects) {
+		surface->screencopy.original_image = image;
+	} else {
+		if (state->args.fade_in && state->args.effects_count > 0) {
+			surface->screencopy.original_image = cairo_surface_duplicate(image);
+			copied += (size_t)cairo_image_surface_get_stride(image) *
+				cairo_image_surface_get_height(image);
+		} else if (state->args.fade_in) {
+			surface->screencopy.original_image = cairo_surface_reference(image);
+		}
+		surface->screencopy.image->cairo_surface = apply_effects(image, state, 1);
+	}
+
+	swaylock_log(LOG_DEBUG, "Screenshot for output %s: copied %zu bytes",
+			surface->output_name, copied);
+	return NULL;
+}
+
+// FNV-1a over 64-bit words sampled evenly across the buffer. This only
+// rules out matches cheaply; a match is confirmed with memcmp.
+#define FINGERPRINT_SAMPLES 4096
+
+static uint64_t screencopy_fingerprint(struct swaylock_surface *surface) {
+	if (surface->screencopy.fingerprinted) {
+		return surface->screencopy.fingerprint;
+	}
+
+	const uint64_t prime = 0x100000001b3;
+	uint64_t hash = 0xcbf29ce484222325;
+	const unsigned char *data = surface->screencopy.data;
+	size_t size = (size_t)surface->screencopy.stride * surface->screencopy.height;
+	size_t words = size / sizeof(uint64_t);
+	size_t step = words / FINGERPRINT_SAMPLES;
+	if (step == 0) {
+		step = 1;
+	}
+	for (size_t i = 0; i < words; i += step) {
+		uint64_t word;
+		memcpy(&word, data + i * sizeof(word), sizeof(word));
+		hash = (hash ^ word) * prime;
+	}
+
+	surface->screencopy.fingerprint = hash;
+	surface->screencopy.fingerprinted = true;
+	return hash;
+}
+
+// Whether two screenshots could be identical, going by their buffers.
+static bool screencopy_same_geometry(struct swaylock_surface *a,
+		struct swaylock_surface *b) {
+	return a->screencopy.format == b->screencopy.format &&
+		a->screencopy.width == b->screencopy.width &&
+		a->screencopy.height == b->screencopy.height &&
+		a->screencopy.stride == b->screencopy.stride &&
+		a->screencopy.transform == b->screencopy.transform &&
+		a->scale == b->scale;
+}
+
+static bool screencopy_matches(struct swaylock_surface *a,
+		struct swaylock_surface *b) {
+	size_t size = (size_t)a->screencopy.stride * a->screencopy.height;
+	return screencopy_same_geometry(a, b) &&
+		screencopy_fingerprint(a) == screencopy_fingerprint(b) &&
+		memcmp(a->screencopy.data, b->screencopy.data, size) == 0;
+}
+
+static void start_screenshot_worker(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	surface->screencopy.ready = false;
+
+	// Split the cores between the outputs whose effects run at the same time
+	int n_outputs = 0;
+	struct swaylock_surface *other;
+	wl_list_for_each(other, &state->surfaces, link) {
+		if (other->screencopy.needed && other->screencopy.source == NULL) {
+			++n_outputs;
+		}
+	}
+	int n_threads = omp_get_num_procs() / (n_outputs > 0 ? n_outputs : 1);
+	surface->screencopy.threads = n_threads > 0 ? n_threads : 1;
+
+	surface->screencopy.apply_effects = state->args.screenshots;
+	if (pthread_create(&surface->screencopy.worker, NULL,
+			screenshot_worker, surface) == 0) {
+		surface->screencopy.worker_started = true;
+	} else {
+		swaylock_log(LOG_ERROR, "Failed to start screenshot worker for output %s",
+				surface->output_name);
+		screenshot_worker(surface);
+	}
+}
+
+// Whether another output with the same geometry is still being copied.
+// Mirrored outputs can only be told apart from their raw pixels, which the
+// worker consumes, so a screenshot which may be a mirror waits for the rest.
+static bool screencopy_awaits_twin(struct swaylock_surface *surface) {
+	struct swaylock_surface *other;
+	wl_list_for_each(other, &surface->state->surfaces, link) {
+		if (other != surface && other->screencopy.buffer != NULL &&
+				screencopy_same_geometry(surface, other)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Hands the ready screenshots to workers. Mirrored outputs produce identical
+// screenshots; only the first of them is processed, and the result shared.
+// With 'flush', screenshots stop waiting for outputs still being copied.
+static void start_screenshot_workers(struct swaylock_state *state, bool flush) {
+	struct swaylock_surface *surface, *other;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!surface->screencopy.ready ||
+				(!flush && screencopy_awaits_twin(surface))) {
+			continue;
+		}
+		wl_list_for_each(other, &state->surfaces, link) {
+			if (other == surface) {
+				break;
+			}
+			if (other->screencopy.ready && other->screencopy.source == NULL &&
+					screencopy_matches(surface, other)) {
+				swaylock_log(LOG_DEBUG, "Screenshot for output %s is identical "
+						"to %s, sharing it", surface->output_name, other->output_name);
+				surface->screencopy.source = other;
+				surface->screencopy.ready = false;
+				shm_free(state->shm_allocator, surface->screencopy.data);
+				surface->screencopy.data = NULL;
+				break;
+			}
+		}
+	}
+
+	// Only start the workers once all comparisons are done,
+	// as they consume the raw pixels
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->screencopy.ready &&
+				(flush || !screencopy_awaits_twin(surface))) {
+			start_screenshot_worker(surface);
+		}
+	}
+}
+
+static void handle_screencopy_frame_ready(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	swaylock_trace();
+	struct swaylock_surface *surface = data;
+
+	// The compositor is done with the buffer, but we keep the mapping
+	wl_buffer_destroy(surface->screencopy.buffer);
+	surface->screencopy.buffer = NULL;
+
+	surface->screencopy.ready = true;
+	start_screenshot_workers(surface->state, false);
 
 	--surface->events_pending;
 }
@@ -576,9 +1058,16 @@ static void handle_screencopy_frame_failed(void *data,
 		struct zwlr_screencopy_frame_v1 *frame) {
 	swaylock_trace();
 	struct swaylock_surface *surface = data;
-	swaylock_log(LOG_ERROR, "Screencopy failed");
-	surface->state->args.screenshots = false;
-	surface->state->args.fade_in = 0; // Fade in is not possible without screenshot
+	surface->screencopy.failed = true;
+
+	if (surface->screencopy.buffer) {
+		wl_buffer_destroy(surface->screencopy.buffer);
+		surface->screencopy.buffer = NULL;
+		shm_free(surface->state->shm_allocator, surface->screencopy.data);
+		surface->screencopy.data = NULL;
+	}
+	// Screenshots which were waiting to be compared with this one
+	start_screenshot_workers(surface->state, false);
 
 	--surface->events_pending;
 }
@@ -588,30 +1077,139 @@ static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener
 	.flags = handle_screencopy_frame_flags,
 	.ready = handle_screencopy_frame_ready,
 	.failed = handle_screencopy_frame_failed,
+	.damage = handle_screencopy_frame_damage,
+	.linux_dmabuf = handle_screencopy_frame_linux_dmabuf,
+	.buffer_done = handle_screencopy_frame_buffer_done,
 };
 
-static void handle_wl_output_done(void *data, struct wl_output *output) {
-	swaylock_trace();
-	struct swaylock_surface *surface = data;
-	struct swaylock_state *state = surface->state;
+// Whether the screenshot of this output would ever be shown: either as the
+// background itself, or as what the background fades in from. This has to
+// be decided before the screenshots are added to state->images, so that
+// select_image only sees the -i images.
+static bool output_needs_capture(struct swaylock_state *state,
+		struct swaylock_surface *surface) {
+	if (state->args.mode == BACKGROUND_MODE_SOLID_COLOR) {
+		return false;
+	}
+	if (state->args.screenshots) {
+		return true;
+	}
+	return state->args.fade_in && find_image(state, surface->output_name) != NULL;
+}
+
+// Requests screenshots of all outputs which need one at once. Each
+// screenshot is handed to a worker as soon as it's ready, see
+// handle_screencopy_frame_ready.
+static void capture_outputs(struct swaylock_state *state) {
+	struct swaylock_surface *surface;
+	int n_captures = 0;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		surface->screencopy.needed = output_needs_capture(state, surface);
+		if (surface->screencopy.needed) {
+			++n_captures;
+		} else {
+			swaylock_log(LOG_DEBUG, "Skipping screenshot for output %s, "
+					"it wouldn't be shown", surface->output_name);
+		}
+	}
+	if (n_captures == 0) {
+		return;
+	}
 
-	static bool has_printed_screencopy_error = false;
-	if (state->screencopy_manager) {
+	if (!state->screencopy_manager) {
+		swaylock_log(LOG_INFO, "Compositor does not support screencopy manager, "
+				"screenshots / fade-in will not work");
+		state->args.screenshots = false;
+		state->args.fade_in = 0; // Fade in is not possible without screenshot
+		return;
+	}
+
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!surface->screencopy.needed) {
+			continue;
+		}
 		surface->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
 				state->screencopy_manager, false, surface->output);
 		zwlr_screencopy_frame_v1_add_listener(surface->screencopy_frame,
 				&screencopy_frame_listener, surface);
 		surface->events_pending += 1;
 		swaylock_log(LOG_DEBUG, "incremented events_pending screen copy");
-	} else if (!has_printed_screencopy_error) {
-		swaylock_log(LOG_INFO, "Compositor does not support screencopy manager, "
-				"screenshots / fade-in will not work");
-		state->args.screenshots = false;
-		state->args.fade_in = 0; // Fade in is not possible without screenshot
-		has_printed_screencopy_error = true;
 	}
+	wl_display_flush(state->display);
+}
 
+// Takes over the processed screenshot of the output this one mirrors.
+// The surfaces are reference counted, so each output can drop its own.
+static void share_screenshot(struct swaylock_surface *surface) {
+	struct swaylock_surface *source = surface->screencopy.source;
+	surface->screencopy.source = NULL;
+
+	if (source->screencopy.failed) {
+		surface->screencopy.failed = true;
+		return;
+	}
+	if (source->screencopy.original_image) {
+		surface->screencopy.original_image =
+			cairo_surface_reference(source->screencopy.original_image);
+	}
+	if (source->screencopy.image && source->screencopy.image->cairo_surface) {
+		surface->screencopy.image->cairo_surface =
+			cairo_surface_reference(source->screencopy.image->cairo_surface);
+	}
+	surface->screencopy.image_transform = source->screencopy.image_transform;
+}
+
+// Waits for the screenshot workers, and adds their images to state->images.
+static void finish_screenshots(struct swaylock_state *state) {
+	struct swaylock_surface *surface;
+	// Outputs which went away mid-capture won't ever be ready, and may
+	// have left their screenshot to a mirror
+	start_screenshot_workers(state, true);
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->screencopy.worker_started) {
+			pthread_join(surface->screencopy.worker, NULL);
+			surface->screencopy.worker_started = false;
+		}
+	}
+
+	// Pick up the shared results for outputs which had identical screenshots.
+	// The surfaces are reference counted, so each output can drop its own.
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->screencopy.source) {
+			share_screenshot(surface);
+		}
+	}
+
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->screencopy.failed) {
+			swaylock_log(LOG_ERROR, "Failed to get screenshot for output %s",
+					surface->output_name);
+			state->args.screenshots = false;
+			state->args.fade_in = 0; // Fade in is not possible without screenshot
+		}
+	}
+
+	if (!state->args.screenshots) {
+		return;
+	}
+
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (surface->screencopy.image && surface->screencopy.image->cairo_surface) {
+			swaylock_log(LOG_DEBUG, "Loaded screenshot for output %s", surface->output_name);
+			wl_list_insert(&state->images, &surface->screencopy.image->link);
+		}
+	}
+}
+
+static void handle_wl_output_done(void *data, struct wl_output *output) {
+	swaylock_trace();
+	struct swaylock_surface *surface = data;
 	--surface->events_pending;
+
+	// The name, if the compositor sends one, comes before done, so now we
+	// know which image this output shows, and at what size
+	surface->described = true;
+	request_images(surface->state);
 }
 
 static void handle_wl_output_name(void *data, struct wl_output *output,
@@ -652,6 +1250,18 @@ static const struct ext_session_lock_v1_listener ext_session_lock_v1_listener =
 	.finished = ext_session_lock_v1_handle_finished,
 };
 
+static void handle_shm_format(void *data, struct wl_shm *shm,
+		uint32_t format) {
+	struct swaylock_state *state = data;
+	if (format == WL_SHM_FORMAT_RGB565) {
+		state->shm_rgb565 = true;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = handle_shm_format,
+};
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct swaylock_state *state = data;
@@ -664,6 +1274,16 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name,
 				&wl_shm_interface, 1);
+		wl_shm_add_listener(state->shm, &shm_listener, state);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(registry, name,
+				&wp_viewporter_interface, 1);
+	} else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		state->single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+		state->fractional_scale_manager = wl_registry_bind(registry, name,
+				&wp_fractional_scale_manager_v1_interface, 1);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
 		struct wl_seat *seat = wl_registry_bind(
 				registry, name, &wl_seat_interface, 4);
@@ -682,12 +1302,15 @@ static void handle_global(void *data, struct wl_registry *registry,
 		wl_list_insert(&state->surfaces, &surface->link);
 
 		if (state->run_display) {
+			// Get the output name first, so we pick the right image
+			wl_display_roundtrip(state->display);
 			create_surface(surface);
 			wl_display_roundtrip(state->display);
 		}
 	} else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+		// Version 3 lets us see all buffer offers before picking one
 		state->screencopy_manager = wl_registry_bind(registry, name,
-				&zwlr_screencopy_manager_v1_interface, 1);
+				&zwlr_screencopy_manager_v1_interface, version < 3 ? version : 3);
 	} else if (strcmp(interface, ext_session_lock_manager_v1_interface.name) == 0) {
 		state->ext_session_lock_manager_v1 = wl_registry_bind(registry, name,
 				&ext_session_lock_manager_v1_interface, 1);
@@ -717,20 +1340,256 @@ void do_sigusr(int sig) {
 	(void)write(sigusr_fds[1], "1", 1);
 }
 
-static cairo_surface_t *select_image(struct swaylock_state *state,
-		struct swaylock_surface *surface) {
+// Finds the image an output would show, whether or not it's loaded yet.
+static struct swaylock_image *find_image(struct swaylock_state *state,
+		const char *output_name) {
 	struct swaylock_image *image;
-	cairo_surface_t *default_image = NULL;
+	struct swaylock_image *default_image = NULL;
 	wl_list_for_each(image, &state->images, link) {
-		if (lenient_strcmp(image->output_name, surface->output_name) == 0) {
-			return image->cairo_surface;
+		if (lenient_strcmp(image->output_name, (char *)output_name) == 0) {
+			return image;
 		} else if (!image->output_name) {
-			default_image = image->cairo_surface;
+			default_image = image;
 		}
 	}
 	return default_image;
 }
 
+// Decodes an -i image at its load size and runs the effects on it, or maps
+// the result from the cache.
+static cairo_surface_t *load_image_surface(struct swaylock_image *image) {
+	struct swaylock_state *state = image->state;
+
+	// With a warm cache, neither decoding nor the effects are needed.
+	// Timing the effects means actually running them.
+	char *cache_key = NULL;
+	if (!state->args.time_effects) {
+		cache_key = background_cache_key(image->path,
+				image->load_width, image->load_height, state->args.mode,
+				state->args.effects, state->args.effects_count,
+				state->args.planar_effects, state->effects_downscale);
+	}
+	if (cache_key) {
+		cairo_surface_t *cached = background_cache_load(cache_key);
+		if (cached) {
+			swaylock_log(LOG_DEBUG, "Loaded image %s for output %s from cache",
+					image->path, image->output_name ? image->output_name : "*");
+			free(cache_key);
+			return cached;
+		}
+	}
+
+	cairo_surface_t *surface = load_background_image(image->path,
+			image->load_width, image->load_height, state->args.mode);
+	if (!surface) {
+		free(cache_key);
+		return NULL;
+	}
+
+	swaylock_log(LOG_DEBUG, "Loaded image %s for output %s", image->path,
+			image->output_name ? image->output_name : "*");
+	surface = apply_effects(surface, state, 1);
+	if (cache_key) {
+		background_cache_store(cache_key, surface);
+		free(cache_key);
+	}
+	return surface;
+}
+
+static void *image_loader(void *data) {
+	struct swaylock_image *image = data;
+	omp_set_num_threads(image->threads);
+	image->cairo_surface = load_image_surface(image);
+	return NULL;
+}
+
+// Images reloaded while locked are passed back to the main loop here,
+// one pointer per image; see fit_image.
+static int image_reload_fds[2] = {-1, -1};
+
+static void *image_reloader(void *data) {
+	struct swaylock_image *image = data;
+	omp_set_num_threads(image->threads);
+	image->reloaded = load_image_surface(image);
+	if (write(image_reload_fds[1], &image, sizeof(image)) != sizeof(image)) {
+		swaylock_log_errno(LOG_ERROR, "Failed to hand back image %s",
+				image->path);
+	}
+	return NULL;
+}
+
+static void start_image_load(struct swaylock_state *state,
+		struct swaylock_image *image, int threads) {
+	image->state = state;
+	image->threads = threads;
+	if (pthread_create(&image->loader, NULL, image_loader, image) == 0) {
+		image->loading = true;
+	} else {
+		swaylock_log(LOG_ERROR, "Failed to start loading image %s", image->path);
+		image_loader(image);
+	}
+}
+
+// The size of the buffers an output's background is rendered into.
+static void output_buffer_size(struct swaylock_surface *surface,
+		int *width, int *height) {
+	if (surface->mode_width <= 0 || surface->mode_height <= 0) {
+		// Unknown, so don't let the image be shrunk at all
+		*width = *height = INT_MAX;
+	} else if (surface->transform & WL_OUTPUT_TRANSFORM_90) {
+		*width = surface->mode_height;
+		*height = surface->mode_width;
+	} else {
+		*width = surface->mode_width;
+		*height = surface->mode_height;
+	}
+}
+
+// Starts decoding an -i image and running the effects on it in the
+// background, unless that already happened. It's decoded at a size that
+// covers every output which shows it.
+static void request_image(struct swaylock_state *state,
+		struct swaylock_image *image) {
+	if (image == NULL || image->path == NULL || image->requested) {
+		return;
+	}
+
+	image->requested = true;
+	image->load_width = image->load_height = 0;
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!surface->described ||
+				find_image(state, surface->output_name) != image) {
+			continue;
+		}
+		int width, height;
+		output_buffer_size(surface, &width, &height);
+		image->load_width = MAX(image->load_width, width);
+		image->load_height = MAX(image->load_height, height);
+	}
+
+	int outputs = wl_list_length(&state->surfaces);
+	int threads = omp_get_num_procs() / (outputs > 0 ? outputs : 1);
+	start_image_load(state, image, threads > 0 ? threads : 1);
+}
+
+// Starts loading the images of all outputs, once they all told us their
+// name and size. Images for outputs which aren't connected are never loaded.
+static void request_images(struct swaylock_state *state) {
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!surface->described) {
+			return;
+		}
+	}
+
+	wl_list_for_each(surface, &state->surfaces, link) {
+		request_image(state, find_image(state, surface->output_name));
+	}
+}
+
+// Swaps a reloaded image in on the outputs which show the old one.
+static void replace_image(struct swaylock_state *state,
+		struct swaylock_image *image, cairo_surface_t *surface) {
+	cairo_surface_t *old = image->cairo_surface;
+	image->cairo_surface = surface;
+
+	struct swaylock_surface *iter;
+	wl_list_for_each(iter, &state->surfaces, link) {
+		if (iter->image == old) {
+			iter->image = surface;
+			render_frame_background(iter, true);
+		}
+	}
+	cairo_surface_destroy(old);
+}
+
+static void fit_image(struct swaylock_state *state,
+		struct swaylock_image *image, struct swaylock_surface *surface);
+
+static void handle_image_reloaded(int fd, short mask, void *data) {
+	struct swaylock_state *state = data;
+	struct swaylock_image *image;
+	if (read(fd, &image, sizeof(image)) != sizeof(image)) {
+		return;
+	}
+
+	pthread_join(image->loader, NULL);
+	image->reloading = false;
+	cairo_surface_t *reloaded = image->reloaded;
+	image->reloaded = NULL;
+	if (reloaded == NULL) {
+		return;
+	}
+	replace_image(state, image, reloaded);
+
+	// Outputs connected in the meantime may need it larger still
+	struct swaylock_surface *iter;
+	wl_list_for_each(iter, &state->surfaces, link) {
+		if (iter->image == reloaded) {
+			fit_image(state, image, iter);
+		}
+	}
+}
+
+// An output connected later may need the image at a larger size than it was
+// loaded at. Loads it again if so, and swaps it in on the other outputs.
+// While locked, that happens on a worker, so that input and frames aren't
+// held up by the effects; the output shows the smaller image until then.
+static void fit_image(struct swaylock_state *state,
+		struct swaylock_image *image, struct swaylock_surface *surface) {
+	int width, height;
+	output_buffer_size(surface, &width, &height);
+	if (image->path == NULL || image->cairo_surface == NULL ||
+			image->reloading ||
+			(width <= image->load_width && height <= image->load_height)) {
+		return;
+	}
+
+	image->load_width = MAX(image->load_width, width);
+	image->load_height = MAX(image->load_height, height);
+	image->threads = omp_get_num_procs();
+	if (state->run_display && pthread_create(&image->loader, NULL,
+			image_reloader, image) == 0) {
+		image->reloading = true;
+		return;
+	}
+
+	cairo_surface_t *reloaded = load_image_surface(image);
+	if (reloaded != NULL) {
+		replace_image(state, image, reloaded);
+	}
+}
+
+static void wait_for_image(struct swaylock_image *image) {
+	if (image->loading) {
+		pthread_join(image->loader, NULL);
+		image->loading = false;
+	}
+}
+
+static cairo_surface_t *select_image(struct swaylock_state *state,
+		struct swaylock_surface *surface) {
+	struct swaylock_image *image = find_image(state, surface->output_name);
+	if (image == NULL) {
+		return NULL;
+	}
+
+	request_image(state, image);
+	wait_for_image(image);
+	if (image->cairo_surface == NULL && image->output_name != NULL) {
+		// Fall back to the default image if this one failed to load
+		image = find_image(state, NULL);
+		if (image == NULL) {
+			return NULL;
+		}
+		request_image(state, image);
+		wait_for_image(image);
+	}
+	fit_image(state, image, surface);
+	return image->cairo_surface;
+}
+
 static char *join_args(char **argv, int argc) {
 	assert(argc > 0);
 	int len = 0, i;
@@ -773,7 +1632,6 @@ static void load_image(char *arg, struct swaylock_state *state) {
 						image->path);
 			}
 			wl_list_remove(&iter_image->link);
-			free(iter_image->cairo_surface);
 			free(iter_image->output_name);
 			free(iter_image->path);
 			free(iter_image);
@@ -797,16 +1655,9 @@ static void load_image(char *arg, struct swaylock_state *state) {
 		wordfree(&p);
 	}
 
-	// Load the actual image
-	image->cairo_surface = load_background_image(image->path);
-	if (!image->cairo_surface) {
-		free(image);
-		return;
-	}
-
+	// The image itself is only loaded once an output needs it, see
+	// request_image
 	wl_list_insert(&state->images, &image->link);
-	swaylock_log(LOG_DEBUG, "Loaded image %s for output %s", image->path,
-			image->output_name ? image->output_name : "*");
 }
 
 static void set_default_colors(struct swaylock_colors *colors) {
@@ -901,6 +1752,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		LO_EFFECT_COMPOSE,
 		LO_EFFECT_CUSTOM,
 		LO_TIME_EFFECTS,
+		LO_PLANAR_EFFECTS,
+		LO_BACKGROUND_FORMAT,
 		LO_INDICATOR,
 		LO_CLOCK,
 		LO_TIMESTR,
@@ -977,6 +1830,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"effect-compose", required_argument, NULL, LO_EFFECT_COMPOSE},
 		{"effect-custom", required_argument, NULL, LO_EFFECT_CUSTOM},
 		{"time-effects", no_argument, NULL, LO_TIME_EFFECTS},
+		{"planar-effects", no_argument, NULL, LO_PLANAR_EFFECTS},
+		{"background-format", required_argument, NULL, LO_BACKGROUND_FORMAT},
 		{"indicator", no_argument, NULL, LO_INDICATOR},
 		{"clock", no_argument, NULL, LO_CLOCK},
 		{"timestr", required_argument, NULL, LO_TIMESTR},
@@ -991,6 +1846,7 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 
 	const char usage[] =
 		"Usage: swaylock [options...]\n"
+		"       swaylock --convert-image <in> <out>\n"
 		"\n"
 		"  -C, --config <config_file>       "
 			"Path to the config file.\n"
@@ -1036,6 +1892,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Image scaling mode: stretch, fill, fit, center, tile, solid_color.\n"
 		"  -T, --tiling                     "
 			"Same as --scaling=tile.\n"
+		"  --background-format <format>     "
+			"Pixel format of background buffers: auto or rgb565.\n"
 		"  -u, --no-unlock-indicator        "
 			"Disable the unlock indicator.\n"
 		"  --indicator                      "
@@ -1144,8 +2002,13 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Apply a custom effect from a shared object or C source file.\n"
 		"  --time-effects                   "
 			"Measure the time it takes to run each effect.\n"
+		"  --planar-effects                 "
+			"Run effects on separate 16-bit color channels.\n"
+		"\n"
+		"All <color> options are of the form <rrggbb[aa]>.\n"
 		"\n"
-		"All <color> options are of the form <rrggbb[aa]>.\n";
+		"With --convert-image, the image <in> is stored as <out> in a raw format\n"
+		"which loads without decoding, and nothing is locked.\n";
 
 	int c;
 	optind = 1;
@@ -1509,6 +2372,24 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.time_effects = true;
 			}
 			break;
+		case LO_PLANAR_EFFECTS:
+			if (state) {
+				state->args.planar_effects = true;
+			}
+			break;
+		case LO_BACKGROUND_FORMAT:
+			if (state) {
+				if (strcmp(optarg, "auto") == 0) {
+					state->args.background_format = 0;
+				} else if (strcmp(optarg, "rgb565") == 0) {
+					state->args.background_format = WL_SHM_FORMAT_RGB565;
+				} else {
+					swaylock_log(LOG_ERROR, "Unsupported background format: %s",
+							optarg);
+					return 1;
+				}
+			}
+			break;
 		case LO_INDICATOR:
 			if (state) {
 				state->args.indicator = true;
@@ -1711,8 +2592,40 @@ static void timer_render(void *data) {
 	loop_add_timer(state->eventloop, 1000, timer_render, state);
 }
 
+// swaylock --convert-image <in> <out> stores an image in the raw format, so
+// that it loads without decoding.
+static int convert_image(const char *in, const char *out) {
+	// This runs before the password backend drops the privileges of a
+	// setuid swaylock, and mustn't touch files as root for the caller
+	if (setgid(getgid()) != 0 || setuid(getuid()) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to drop privileges");
+		return EXIT_FAILURE;
+	}
+
+	cairo_surface_t *image = load_background_image(in, 0, 0,
+			BACKGROUND_MODE_FILL);
+	if (image == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	bool ok = write_raw_image(image, NULL, out);
+	cairo_surface_destroy(image);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char **argv) {
 	log_init(argc, argv);
+
+	// A separate mode rather than an option, as it has nothing to do with
+	// locking; handled before the password backend forks or drops privileges
+	if (argc >= 2 && strcmp(argv[1], "--convert-image") == 0) {
+		if (argc != 4) {
+			fprintf(stderr, "Usage: swaylock --convert-image <in> <out>\n");
+			return EXIT_FAILURE;
+		}
+		return convert_image(argv[2], argv[3]);
+	}
+
 	initialize_pw_backend(argc, argv);
 	srand(time(NULL));
 
@@ -1791,6 +2704,21 @@ int main(int argc, char **argv) {
 		state.auth_state = AUTH_STATE_GRACE;
 	}
 
+	// Centered and tiled images are drawn at their own size, so they have
+	// to stay full size. The other modes scale the image to the output
+	// anyway, wherever the background is painted.
+	state.effects_downscale = 1;
+	if (state.args.mode == BACKGROUND_MODE_STRETCH ||
+			state.args.mode == BACKGROUND_MODE_FILL ||
+			state.args.mode == BACKGROUND_MODE_FIT) {
+		state.effects_downscale = swaylock_effects_downscale(
+				state.args.effects, state.args.effects_count);
+	}
+	if (state.effects_downscale > 1) {
+		swaylock_log(LOG_DEBUG, "Running effects at 1/%d of the image size",
+				state.effects_downscale);
+	}
+
 	state.password.len = 0;
 	state.password.buffer_len = 1024;
 	state.password.buffer = password_buffer_create(state.password.buffer_len);
@@ -1798,7 +2726,7 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	if (pipe(sigusr_fds) != 0) {
+	if (pipe(sigusr_fds) != 0 || pipe(image_reload_fds) != 0) {
 		swaylock_log(LOG_ERROR, "Failed to pipe");
 		return EXIT_FAILURE;
 	}
@@ -1807,6 +2735,13 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	// Must daemonize before we start any threads, since the image loaders,
+	// screenshot workers and effects (through openmp) use them
+	int daemonfd;
+	if (state.args.daemonize) {
+		daemonfd = daemonize_start();
+	}
+
 	wl_list_init(&state.surfaces);
 	state.xkb.context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	state.display = wl_display_connect(NULL);
@@ -1836,6 +2771,18 @@ int main(int argc, char **argv) {
 		swaylock_log(LOG_ERROR, "Missing wl_shm");
 		return 1;
 	}
+	state.shm_allocator = shm_allocator_create(state.shm);
+	swaylock_effects_set_allocator(state.shm_allocator);
+
+	if (state.args.background_format == WL_SHM_FORMAT_RGB565) {
+		// wl_shm sends its formats once bound
+		wl_display_roundtrip(state.display);
+		if (!state.shm_rgb565) {
+			swaylock_log(LOG_ERROR, "The compositor doesn't support "
+					"--background-format rgb565");
+			return 1;
+		}
+	}
 
 	if (!state.ext_session_lock_manager_v1) {
 		swaylock_log(LOG_ERROR, "Missing ext-session-lock-v1");
@@ -1858,19 +2805,24 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	// Must daemonize before we run any effects, since effects use openmp
-	int daemonfd;
-	if (state.args.daemonize) {
-		daemonfd = daemonize_start();
+	capture_outputs(&state);
+
+	wl_list_for_each(surface, &state.surfaces, link) {
+		while (surface->events_pending > 0) {
+			wl_display_roundtrip(state.display);
+		}
 	}
 
-	// Need to apply effects to all images *before* requesting ext_session_lock_v1
-	// Otherwise, the screen would be blank while the effects are being applied.
-	struct swaylock_image *iter_image, *temp;
-	wl_list_for_each_safe(iter_image, temp, &state.images, link) {
-		iter_image->cairo_surface = apply_effects(
-				iter_image->cairo_surface, &state, 1);
+	finish_screenshots(&state);
+
+	// Need to have the images of all outputs loaded and processed *before*
+	// requesting ext_session_lock_v1. Otherwise, the screen would be blank
+	// while the effects are being applied. Images no output shows are never
+	// waited for. The backgrounds are painted then too, all in parallel.
+	wl_list_for_each(surface, &state.surfaces, link) {
+		select_surface_image(surface);
 	}
+	prerender_surfaces(&state);
 
 	state.ext_session_lock_v1 = ext_session_lock_manager_v1_lock(state.ext_session_lock_manager_v1);
 	ext_session_lock_v1_add_listener(state.ext_session_lock_v1,
@@ -1918,6 +2870,9 @@ int main(int argc, char **argv) {
 
 	loop_add_fd(state.eventloop, sigusr_fds[0], POLLIN, term_in, NULL);
 
+	loop_add_fd(state.eventloop, image_reload_fds[0], POLLIN,
+			handle_image_reloaded, &state);
+
 	struct sigaction sa;
 	sa.sa_handler = do_sigusr;
 	sigemptyset(&sa.sa_mask);
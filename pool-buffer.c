@@ -1,41 +1,10 @@
 #define _POSIX_C_SOURCE 200809L
-#include <assert.h>
 #include <cairo/cairo.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <time.h>
-#include <unistd.h>
 #include <wayland-client.h>
 #include "pool-buffer.h"
-
-static int anonymous_shm_open(void) {
-	int retries = 100;
-
-	do {
-		// try a probably-unique name
-		struct timespec ts;
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		pid_t pid = getpid();
-		char name[50];
-		snprintf(name, sizeof(name), "/swaylock-%x-%x",
-			(unsigned int)pid, (unsigned int)ts.tv_nsec);
-
-		// shm_open guarantees that O_CLOEXEC is set
-		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-		if (fd >= 0) {
-			shm_unlink(name);
-			return fd;
-		}
-
-		--retries;
-	} while (retries > 0 && errno == EEXIST);
-
-	return -1;
-}
+#include "shm-allocator.h"
 
 static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
 	struct pool_buffer *buffer = data;
@@ -46,37 +15,42 @@ static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release
 };
 
-struct pool_buffer *create_buffer(struct wl_shm *shm,
+static cairo_format_t cairo_format_for_shm(uint32_t format) {
+	switch (format) {
+	case WL_SHM_FORMAT_XRGB8888:
+		return CAIRO_FORMAT_RGB24;
+	case WL_SHM_FORMAT_RGB565:
+		return CAIRO_FORMAT_RGB16_565;
+	default:
+		return CAIRO_FORMAT_ARGB32;
+	}
+}
+
+struct pool_buffer *create_buffer(struct shm_allocator *shm,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format) {
-	uint32_t stride = width * 4;
+	cairo_format_t cairo_format = cairo_format_for_shm(format);
+	uint32_t stride = cairo_format_stride_for_width(cairo_format, width);
 	size_t size = stride * height;
 
 	void *data = NULL;
 	if (size > 0) {
-		int fd = anonymous_shm_open();
-		if (fd == -1) {
+		buf->buffer = shm_create_buffer(shm, width, height, stride, format,
+				&data);
+		if (buf->buffer == NULL) {
 			return NULL;
 		}
-		if (ftruncate(fd, size) < 0) {
-			close(fd);
-			return NULL;
-		}
-		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-		buf->buffer = wl_shm_pool_create_buffer(pool, 0,
-				width, height, stride, format);
 		wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
-		wl_shm_pool_destroy(pool);
-		close(fd);
 	}
 
+	buf->shm = shm;
 	buf->size = size;
 	buf->width = width;
 	buf->height = height;
+	buf->format = format;
 	buf->data = data;
-	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
+	buf->surface = cairo_image_surface_create_for_data(data, cairo_format,
+			width, height, stride);
 	buf->cairo = cairo_create(buf->surface);
 	return buf;
 }
@@ -92,13 +66,14 @@ void destroy_buffer(struct pool_buffer *buffer) {
 		cairo_surface_destroy(buffer->surface);
 	}
 	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
+		shm_free(buffer->shm, buffer->data);
 	}
 	memset(buffer, 0, sizeof(struct pool_buffer));
 }
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
+struct pool_buffer *get_next_buffer(struct shm_allocator *shm,
+		struct pool_buffer pool[static 2], uint32_t width, uint32_t height,
+		uint32_t format) {
 	struct pool_buffer *buffer = NULL;
 
 	for (size_t i = 0; i < 2; ++i) {
@@ -112,13 +87,13 @@ struct pool_buffer *get_next_buffer(struct wl_shm *shm,
 		return NULL;
 	}
 
-	if (buffer->width != width || buffer->height != height) {
+	if (buffer->width != width || buffer->height != height ||
+			buffer->format != format) {
 		destroy_buffer(buffer);
 	}
 
 	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
-					WL_SHM_FORMAT_ARGB8888)) {
+		if (!create_buffer(shm, buffer, width, height, format)) {
 			return NULL;
 		}
 	}
@@ -7,6 +7,9 @@
 #include "background-image.h"
 #include "swaylock.h"
 #include "log.h"
+#include "shm-allocator.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 #define M_PI 3.14159265358979323846
 const float TYPE_INDICATOR_RANGE = M_PI / 3.0f;
@@ -64,62 +67,471 @@ static void timetext(struct swaylock_surface *surface, char **tstr, char **dstr)
 	setlocale(LC_TIME, prevloc);
 }
 
-void render_frame_background(struct swaylock_surface *surface, bool commit) {
-	struct swaylock_state *state = surface->state;
+// Paints a prescaled image, which is a copy. This runs on several threads
+// at once, for stripes and for outputs showing the same image, so it paints
+// from an alias.
+static void paint_prescaled(cairo_t *cairo, struct prescaled_image *prescaled,
+		double alpha) {
+	cairo_surface_t *image = cairo_image_surface_alias(prescaled->image);
+	cairo_set_source_surface(cairo, image, prescaled->x, prescaled->y);
+	cairo_paint_with_alpha(cairo, alpha);
+	cairo_surface_destroy(image);
+}
 
-	int buffer_width = surface->width * surface->scale;
-	int buffer_height = surface->height * surface->scale;
-	if (buffer_width == 0 || buffer_height == 0) {
-		return; // not yet configured
+// The scale buffers for the surface are drawn at. A fractional scale the
+// compositor prefers is applied with a viewport instead of a buffer scale.
+static double surface_buffer_scale(struct swaylock_surface *surface,
+		bool *fractional) {
+	uint32_t preferred = surface->preferred_scale;
+	*fractional = preferred > 0 && surface->state->viewporter &&
+		preferred != (uint32_t)surface->scale * 120;
+	return *fractional ? preferred / 120.0 : surface->scale;
+}
+
+// The processed image itself can be attached if it was made at exactly the
+// size it's shown at, in shared memory. Returns NULL if it has to be copied.
+static struct wl_buffer *background_image_buffer(struct swaylock_surface *surface) {
+	cairo_surface_t *image = surface->background.image;
+	if (image != surface->image ||
+			cairo_image_surface_get_format(image) != CAIRO_FORMAT_RGB24) {
+		return NULL;
 	}
+	return shm_image_get_buffer(image);
+}
 
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
+static void count_saved_copy(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	++state->frame_copies_saved;
+	swaylock_log(LOG_DEBUG, "Attached the background of output %s without "
+			"a copy (%zu full-frame copies saved)", surface->output_name,
+			state->frame_copies_saved);
+}
 
-	if (buffer_width != surface->last_buffer_width ||
-			buffer_height != surface->last_buffer_height) {
-		struct pool_buffer buffer;
-		if (!create_buffer(state->shm, &buffer, buffer_width, buffer_height,
-				WL_SHM_FORMAT_ARGB8888)) {
-			swaylock_log(LOG_ERROR,
-				"Failed to create new buffer for frame background.");
-			return;
+static void release_background_buffers(struct swaylock_surface *surface) {
+	for (size_t i = 0; i < 2; ++i) {
+		if (!surface->background_buffers[i].busy) {
+			destroy_buffer(&surface->background_buffers[i]);
 		}
+	}
+}
 
-		cairo_t *cairo = buffer.cairo;
-		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
-
-		cairo_save(cairo);
-		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-		cairo_set_source_u32(cairo, state->args.colors.background);
-		cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_BILINEAR);
-		cairo_paint(cairo);
-		if (surface->image && state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
-			cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
-			if (fade_is_complete(&surface->fade)) {
-				render_background_image(cairo, surface->image,
-					state->args.mode, buffer_width, buffer_height, 1);
-			} else {
-				render_background_image(cairo, surface->screencopy.original_image,
-					state->args.mode, buffer_width, buffer_height, 1);
-				render_background_image(cairo, surface->image,
-					state->args.mode, buffer_width, buffer_height, surface->fade.alpha);
+static void hide_image_subsurface(struct swaylock_surface *surface) {
+	if (surface->image_child) {
+		wl_surface_attach(surface->image_child, NULL, 0, 0);
+		wl_surface_commit(surface->image_child);
+	}
+}
+
+// Whether prerender_frame_background already painted what is about to be
+// painted into buffer. Either way, the buffer is painted over from now on.
+static bool take_prerendered(struct swaylock_surface *surface,
+		struct pool_buffer *buffer) {
+	bool prerendered = buffer == surface->prerendered.buffer &&
+		buffer->width == surface->prerendered.width &&
+		buffer->height == surface->prerendered.height &&
+		buffer->format == surface->prerendered.format &&
+		surface->image == surface->prerendered.image;
+	surface->prerendered.buffer = NULL;
+	return prerendered;
+}
+
+static struct pool_buffer *paint_image_buffer(struct swaylock_surface *surface) {
+	struct prescaled_image *prescaled = &surface->background;
+	struct pool_buffer *buffer = get_next_buffer(surface->state->shm_allocator,
+			surface->image_buffers,
+			cairo_image_surface_get_width(prescaled->image),
+			cairo_image_surface_get_height(prescaled->image),
+			WL_SHM_FORMAT_ARGB8888);
+	if (buffer == NULL || take_prerendered(surface, buffer)) {
+		return buffer;
+	}
+
+	cairo_t *cairo = buffer->cairo;
+	cairo_surface_t *image = cairo_image_surface_alias(prescaled->image);
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cairo, image, 0, 0);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+	cairo_surface_destroy(image);
+	cairo_surface_flush(buffer->surface);
+	return buffer;
+}
+
+// Shows the background colour as a single pixel buffer, which the compositor
+// scales to the output, and the image on a subsurface of its own size.
+static bool render_single_pixel_background(struct swaylock_surface *surface,
+		bool show_image) {
+	struct swaylock_state *state = surface->state;
+
+	if (show_image) {
+		struct prescaled_image *prescaled = &surface->background;
+		struct wl_buffer *image_buffer = background_image_buffer(surface);
+		if (image_buffer) {
+			count_saved_copy(surface);
+		} else {
+			struct pool_buffer *buffer = paint_image_buffer(surface);
+			if (buffer == NULL) {
+				return false;
 			}
+			image_buffer = buffer->buffer;
 		}
-		cairo_restore(cairo);
-		cairo_identity_matrix(cairo);
 
-		wl_surface_attach(surface->surface, buffer.buffer, 0, 0);
-		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
-		if (commit) {
-			wl_surface_commit(surface->surface);
+		if (surface->image_child == NULL) {
+			surface->image_child = wl_compositor_create_surface(state->compositor);
+			surface->image_subsurface = wl_subcompositor_get_subsurface(
+					state->subcompositor, surface->image_child, surface->surface);
+			wl_subsurface_place_below(surface->image_subsurface, surface->child);
+			wl_subsurface_set_sync(surface->image_subsurface);
+		}
+		wl_subsurface_set_position(surface->image_subsurface,
+				prescaled->x / surface->scale, prescaled->y / surface->scale);
+		wl_surface_set_buffer_scale(surface->image_child, surface->scale);
+		wl_surface_attach(surface->image_child, image_buffer, 0, 0);
+		wl_surface_damage_buffer(surface->image_child, 0, 0, INT32_MAX, INT32_MAX);
+		wl_surface_commit(surface->image_child);
+	} else {
+		hide_image_subsurface(surface);
+	}
+
+	if (surface->solid_buffer == NULL) {
+		// The protocol wants premultiplied alpha
+		uint32_t color = state->args.colors.background;
+		uint32_t a = color & 0xFF;
+		uint32_t r = ((color >> 24 & 0xFF) * a + 127) / 255;
+		uint32_t g = ((color >> 16 & 0xFF) * a + 127) / 255;
+		uint32_t b = ((color >> 8 & 0xFF) * a + 127) / 255;
+		surface->solid_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+				state->single_pixel_buffer_manager,
+				r * 0x01010101, g * 0x01010101, b * 0x01010101, a * 0x01010101);
+	}
+	if (surface->viewport == NULL) {
+		surface->viewport = wp_viewporter_get_viewport(state->viewporter,
+				surface->surface);
+	}
+	wp_viewport_set_destination(surface->viewport, surface->width, surface->height);
+	wl_surface_set_buffer_scale(surface->surface, 1);
+	wl_surface_attach(surface->surface, surface->solid_buffer, 0, 0);
+	wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
+
+	// The full size buffers from fading in are done with once released
+	release_background_buffers(surface);
+	return true;
+}
+
+static void paint_background(cairo_t *cairo, struct swaylock_surface *surface,
+		bool show_image) {
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(cairo, surface->state->args.colors.background);
+	cairo_paint(cairo);
+	if (show_image) {
+		cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+		if (surface->original_background.image) {
+			paint_prescaled(cairo, &surface->original_background, 1);
+			paint_prescaled(cairo, &surface->background, surface->fade.alpha);
+		} else {
+			paint_prescaled(cairo, &surface->background, 1);
 		}
-		destroy_buffer(&buffer);
+	}
+	cairo_restore(cairo);
+	cairo_identity_matrix(cairo);
+}
+
+struct background_job {
+	struct swaylock_surface *surface;
+	bool show_image;
+};
+
+static void paint_background_stripe(cairo_t *cairo, void *data) {
+	struct background_job *job = data;
+	paint_background(cairo, job->surface, job->show_image);
+}
 
-		surface->last_buffer_width = buffer_width;
-		surface->last_buffer_height = buffer_height;
+// Paints the background into an image surface, in stripes of rows on
+// separate threads for large ones.
+static void paint_background_striped(cairo_surface_t *target,
+		struct swaylock_surface *surface, bool show_image) {
+	struct background_job job = {
+		.surface = surface,
+		.show_image = show_image,
+	};
+	cairo_image_surface_paint_striped(target, paint_background_stripe, &job);
+}
+
+// Dithers the background into an RGB565 buffer. An opaque image that covers
+// the buffer is packed straight from the prescaled copy.
+static void pack_background(struct pool_buffer *buffer,
+		struct swaylock_surface *surface, bool show_image) {
+	cairo_surface_t *image = surface->background.image;
+	if (show_image && surface->original_background.image == NULL &&
+			cairo_image_surface_get_format(image) == CAIRO_FORMAT_RGB24 &&
+			cairo_image_surface_get_width(image) == (int)buffer->width &&
+			cairo_image_surface_get_height(image) == (int)buffer->height) {
+		pack_rgb565(buffer->data,
+				cairo_image_surface_get_stride(buffer->surface), image);
+		return;
+	}
+
+	cairo_surface_t *composed = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+			buffer->width, buffer->height);
+	paint_background_striped(composed, surface, show_image);
+	pack_rgb565(buffer->data,
+			cairo_image_surface_get_stride(buffer->surface), composed);
+	cairo_surface_destroy(composed);
+}
+
+// Prescaled images are only RGB24 if they're opaque and cover the whole
+// buffer. An opaque buffer lets the compositor skip blending.
+static uint32_t background_buffer_format(struct swaylock_surface *surface,
+		bool show_image) {
+	struct swaylock_state *state = surface->state;
+	if (state->args.background_format != 0) {
+		return state->args.background_format;
+	}
+
+	cairo_surface_t *image = show_image ? surface->background.image : NULL;
+	cairo_surface_t *original = surface->original_background.image;
+	bool opaque = (state->args.colors.background & 0xFF) == 0xFF ||
+		(image && cairo_image_surface_get_format(image) == CAIRO_FORMAT_RGB24 &&
+		 (!original || cairo_image_surface_get_format(original) == CAIRO_FORMAT_RGB24));
+	return opaque ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+}
+
+// The buffer of an image which can be attached as the whole background,
+// if there is one.
+static struct wl_buffer *direct_background_buffer(
+		struct swaylock_surface *surface, bool show_image, uint32_t format) {
+	if (format != WL_SHM_FORMAT_XRGB8888 || !show_image ||
+			surface->original_background.image) {
+		return NULL;
+	}
+	return background_image_buffer(surface);
+}
+
+static struct pool_buffer *paint_buffer_background(
+		struct swaylock_surface *surface, bool show_image,
+		int buffer_width, int buffer_height, uint32_t format) {
+	struct pool_buffer *buffer = get_next_buffer(surface->state->shm_allocator,
+			surface->background_buffers, buffer_width, buffer_height, format);
+	if (buffer == NULL || take_prerendered(surface, buffer)) {
+		return buffer;
+	}
+
+	if (format == WL_SHM_FORMAT_RGB565) {
+		pack_background(buffer, surface, show_image);
 	} else {
+		paint_background_striped(buffer->surface, surface, show_image);
+	}
+	cairo_surface_flush(buffer->surface);
+	return buffer;
+}
+
+static bool render_buffer_background(struct swaylock_surface *surface,
+		bool show_image, int buffer_width, int buffer_height, bool viewported) {
+	struct swaylock_state *state = surface->state;
+
+	uint32_t format = background_buffer_format(surface, show_image);
+	struct wl_buffer *wl_buffer =
+		direct_background_buffer(surface, show_image, format);
+	if (wl_buffer) {
+		count_saved_copy(surface);
+		release_background_buffers(surface);
+	} else {
+		struct pool_buffer *buffer = paint_buffer_background(surface,
+				show_image, buffer_width, buffer_height, format);
+		if (buffer == NULL) {
+			return false;
+		}
+		wl_buffer = buffer->buffer;
+	}
+
+	if (viewported) {
+		if (surface->viewport == NULL) {
+			surface->viewport = wp_viewporter_get_viewport(state->viewporter,
+					surface->surface);
+		}
+		wp_viewport_set_destination(surface->viewport,
+				surface->width, surface->height);
+		wl_surface_set_buffer_scale(surface->surface, 1);
+	} else {
+		if (surface->viewport) {
+			wp_viewport_set_destination(surface->viewport, -1, -1);
+		}
+		wl_surface_set_buffer_scale(surface->surface, surface->scale);
+	}
+	hide_image_subsurface(surface);
+	wl_surface_attach(surface->surface, wl_buffer, 0, 0);
+	wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
+	return true;
+}
+
+// How the background of a surface of some size is put together
+struct background_layout {
+	int buffer_width, buffer_height;
+	double alpha;
+	bool show_image, fading, single_pixel, downscaled;
+	// Drawn at a fractional scale, and mapped to the surface by a viewport
+	bool fractional;
+};
+
+static bool get_background_layout(struct swaylock_surface *surface,
+		uint32_t width, uint32_t height, struct background_layout *layout) {
+	struct swaylock_state *state = surface->state;
+
+	bool fractional;
+	double scale = surface_buffer_scale(surface, &fractional);
+	int buffer_width = fractional ? lround(width * scale) : (int)width * surface->scale;
+	int buffer_height = fractional ? lround(height * scale) : (int)height * surface->scale;
+	if (buffer_width == 0 || buffer_height == 0) {
+		return false; // not yet configured
+	}
+
+	// The image may still be in the output's own orientation,
+	// in which case the compositor rotates the buffer for us.
+	if (surface->image_transform & WL_OUTPUT_TRANSFORM_90) {
+		int tmp = buffer_width;
+		buffer_width = buffer_height;
+		buffer_height = tmp;
+	}
+
+	bool show_image = surface->image &&
+		state->args.mode != BACKGROUND_MODE_SOLID_COLOR;
+	bool fading = show_image && !fade_is_complete(&surface->fade);
+
+	// Unless an image covers the whole output, or is being faded into,
+	// most of the background is just the background colour. The image
+	// subsurface is placed in whole surface coordinates, which don't map
+	// to whole buffer pixels at fractional scales.
+	bool single_pixel = state->single_pixel_buffer_manager && state->viewporter &&
+		!fading && surface->image_transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+		(!show_image || (!fractional &&
+		 (state->args.mode == BACKGROUND_MODE_CENTER ||
+		  state->args.mode == BACKGROUND_MODE_FIT)));
+
+	// Images that were blurred at a fraction of the output size are attached
+	// at that size too, and scaled up by the compositor. Rounding down like
+	// downscale_background_image does keeps the two the same size.
+	bool downscaled = !single_pixel && !fading && show_image &&
+		state->viewporter && state->effects_downscale > 1 &&
+		buffer_width >= state->effects_downscale &&
+		buffer_height >= state->effects_downscale;
+	if (downscaled) {
+		buffer_width /= state->effects_downscale;
+		buffer_height /= state->effects_downscale;
+	}
+
+	*layout = (struct background_layout){
+		.buffer_width = buffer_width,
+		.buffer_height = buffer_height,
+		.alpha = fade_is_complete(&surface->fade) ? 1 : surface->fade.alpha,
+		.show_image = show_image,
+		.fading = fading,
+		.single_pixel = single_pixel,
+		.downscaled = downscaled,
+		.fractional = fractional,
+	};
+	return true;
+}
+
+static void prescale_backgrounds(struct swaylock_surface *surface,
+		struct background_layout *layout) {
+	struct swaylock_state *state = surface->state;
+
+	// Prescaled images are aligned to whole surface coordinates, so that
+	// they can be placed on a subsurface
+	int align = layout->downscaled || layout->fractional ? 1 : surface->scale;
+	if (layout->show_image) {
+		prescaled_image_get(&surface->background, surface->image,
+				state->args.mode, layout->buffer_width, layout->buffer_height,
+				align);
+	}
+	if (layout->fading) {
+		prescaled_image_get(&surface->original_background,
+				surface->screencopy.original_image, state->args.mode,
+				layout->buffer_width, layout->buffer_height, align);
+	} else {
+		prescaled_image_finish(&surface->original_background);
+	}
+}
+
+void prerender_frame_background(struct swaylock_surface *surface,
+		uint32_t width, uint32_t height) {
+	struct background_layout layout;
+	if (!get_background_layout(surface, width, height, &layout)) {
+		return;
+	}
+	prescale_backgrounds(surface, &layout);
+
+	// Buffers which are attached as they are only need their wl_buffer
+	struct pool_buffer *buffer = NULL;
+	if (layout.single_pixel) {
+		if (layout.show_image && !background_image_buffer(surface)) {
+			buffer = paint_image_buffer(surface);
+		}
+	} else {
+		uint32_t format = background_buffer_format(surface, layout.show_image);
+		if (!direct_background_buffer(surface, layout.show_image, format)) {
+			buffer = paint_buffer_background(surface, layout.show_image,
+					layout.buffer_width, layout.buffer_height, format);
+		}
+	}
+
+	surface->prerendered.buffer = buffer;
+	if (buffer) {
+		surface->prerendered.width = buffer->width;
+		surface->prerendered.height = buffer->height;
+		surface->prerendered.format = buffer->format;
+		surface->prerendered.image = surface->image;
+	}
+}
+
+void render_frame_background(struct swaylock_surface *surface, bool commit) {
+	struct background_layout layout;
+	if (!get_background_layout(surface, surface->width, surface->height,
+				&layout)) {
+		return;
+	}
+
+	wl_surface_set_buffer_transform(surface->surface, surface->image_transform);
+
+	// Fade frames need a new buffer even if the size stayed the same.
+	// A background which couldn't get a buffer is still to be painted.
+	if (!surface->background_dirty &&
+			layout.buffer_width == surface->last_buffer_width &&
+			layout.buffer_height == surface->last_buffer_height &&
+			layout.alpha == surface->last_buffer_alpha &&
+			(!layout.show_image || surface->background.source == surface->image)) {
+		wl_surface_commit(surface->surface);
+		return;
+	}
+
+	prescale_backgrounds(surface, &layout);
+
+	bool rendered = layout.single_pixel ?
+		render_single_pixel_background(surface, layout.show_image) :
+		render_buffer_background(surface, layout.show_image,
+				layout.buffer_width, layout.buffer_height,
+				layout.downscaled || layout.fractional);
+	if (!rendered) {
+		// Both buffers are still in use by the compositor, try again on
+		// the next frame
+		swaylock_log(LOG_DEBUG, "No free buffer for frame background.");
+		surface->background_dirty = true;
+		damage_surface(surface);
+		return;
+	}
+
+	if (commit) {
 		wl_surface_commit(surface->surface);
 	}
+
+	surface->last_buffer_width = layout.buffer_width;
+	surface->last_buffer_height = layout.buffer_height;
+	surface->last_buffer_alpha = layout.alpha;
+	surface->background_dirty = false;
 }
 
 static uint32_t get_font_size(struct swaylock_state *state, int arc_radius) {
@@ -216,9 +628,12 @@ void render_frame(struct swaylock_surface *surface) {
 		}
 	}
 
+	bool fractional;
+	double scale = surface_buffer_scale(surface, &fractional);
+
 	// Compute the size of the buffer needed
-	int arc_radius = state->args.radius * surface->scale;
-	int arc_thickness = state->args.thickness * surface->scale;
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
 	int buffer_diameter = (arc_radius + arc_thickness) * 2;
 	int buffer_width = buffer_diameter;
 	int buffer_height = buffer_diameter;
@@ -237,7 +652,7 @@ void render_frame(struct swaylock_surface *surface) {
 		if (layout_text) {
 			cairo_text_extents_t extents;
 			cairo_font_extents_t fe;
-			double box_padding = 4.0 * surface->scale;
+			double box_padding = 4.0 * scale;
 			cairo_text_extents(state->test_cairo, layout_text, &extents);
 			cairo_font_extents(state->test_cairo, &fe);
 			buffer_height += fe.height + 2 * box_padding;
@@ -246,20 +661,32 @@ void render_frame(struct swaylock_surface *surface) {
 			}
 		}
 	}
-	// Ensure buffer size is multiple of buffer scale - required by protocol
-	buffer_height += surface->scale - (buffer_height % surface->scale);
-	buffer_width += surface->scale - (buffer_width % surface->scale);
+	int surface_width, surface_height, half_width;
+	if (fractional) {
+		// The viewport maps the buffer to whole surface coordinates
+		surface_width = ceil(buffer_width / scale);
+		surface_height = ceil(buffer_height / scale);
+		buffer_width = lround(surface_width * scale);
+		buffer_height = lround(surface_height * scale);
+		// Same nudge as below, so the indicator doesn't move between the two
+		half_width = surface_width / 2 - 2 / surface->scale;
+	} else {
+		// Ensure buffer size is multiple of buffer scale - required by protocol
+		buffer_height += surface->scale - (buffer_height % surface->scale);
+		buffer_width += surface->scale - (buffer_width % surface->scale);
+		surface_width = buffer_width / surface->scale;
+		surface_height = buffer_height / surface->scale;
+		half_width = buffer_width / (2 * surface->scale) - 2 / surface->scale;
+	}
 
 	int subsurf_xpos;
 	int subsurf_ypos;
 
 	// Center the indicator unless overridden by the user
 	if (state->args.override_indicator_x_position) {
-		subsurf_xpos = state->args.indicator_x_position -
-			buffer_width / (2 * surface->scale) + 2 / surface->scale;
+		subsurf_xpos = state->args.indicator_x_position - half_width;
 	} else {
-		subsurf_xpos = surface->width / 2 -
-			buffer_width / (2 * surface->scale) + 2 / surface->scale;
+		subsurf_xpos = surface->width / 2 - half_width;
 	}
 
 	if (state->args.override_indicator_y_position) {
@@ -270,8 +697,9 @@ void render_frame(struct swaylock_surface *surface) {
 			(state->args.radius + state->args.thickness);
 	}
 
-	struct pool_buffer *buffer = get_next_buffer(state->shm,
-			surface->indicator_buffers, buffer_width, buffer_height);
+	struct pool_buffer *buffer = get_next_buffer(state->shm_allocator,
+			surface->indicator_buffers, buffer_width, buffer_height,
+			WL_SHM_FORMAT_ARGB8888);
 	if (buffer == NULL) {
 		return;
 	}
@@ -290,7 +718,7 @@ void render_frame(struct swaylock_surface *surface) {
 	cairo_restore(cairo);
 
 	float type_indicator_border_thickness =
-		TYPE_INDICATOR_BORDER_THICKNESS * surface->scale;
+		TYPE_INDICATOR_BORDER_THICKNESS * scale;
 
 	// This is a bit messy.
 	// After the fork, upstream added their own --indicator-idle-visible option,
@@ -417,7 +845,7 @@ void render_frame(struct swaylock_surface *surface) {
 
 		// Draw inner + outer border of the circle
 		set_color_for_state(cairo, state, &state->args.colors.line);
-		cairo_set_line_width(cairo, 2.0 * surface->scale);
+		cairo_set_line_width(cairo, 2.0 * scale);
 		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
 				arc_radius - arc_thickness / 2, 0, 2 * M_PI);
 		cairo_stroke(cairo);
@@ -430,7 +858,7 @@ void render_frame(struct swaylock_surface *surface) {
 			cairo_text_extents_t extents;
 			cairo_font_extents_t fe;
 			double x, y;
-			double box_padding = 4.0 * surface->scale;
+			double box_padding = 4.0 * scale;
 			cairo_text_extents(cairo, layout_text, &extents);
 			cairo_font_extents(cairo, &fe);
 			// upper left coordinates for box
@@ -460,7 +888,20 @@ void render_frame(struct swaylock_surface *surface) {
 	// Send Wayland requests
 	wl_subsurface_set_position(surface->subsurface, subsurf_xpos, subsurf_ypos);
 
-	wl_surface_set_buffer_scale(surface->child, surface->scale);
+	if (fractional) {
+		if (surface->child_viewport == NULL) {
+			surface->child_viewport = wp_viewporter_get_viewport(
+					state->viewporter, surface->child);
+		}
+		wp_viewport_set_destination(surface->child_viewport,
+				surface_width, surface_height);
+		wl_surface_set_buffer_scale(surface->child, 1);
+	} else {
+		if (surface->child_viewport) {
+			wp_viewport_set_destination(surface->child_viewport, -1, -1);
+		}
+		wl_surface_set_buffer_scale(surface->child, surface->scale);
+	}
 	wl_surface_attach(surface->child, buffer->buffer, 0, 0);
 	wl_surface_damage_buffer(surface->child, 0, 0, INT32_MAX, INT32_MAX);
 	wl_surface_commit(surface->child);
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "log.h"
+#include "shm-allocator.h"
+
+// Address space reserved for each pool, so that growing it never moves
+// the buffers already handed out. Only what's used is backed by memory.
+// 32-bit processes have little address space to spare.
+#define POOL_RESERVE ((size_t)(sizeof(void *) == 4 ? 64 : 512) * 1024 * 1024)
+#define HUGEPAGE_SIZE ((size_t)2 * 1024 * 1024)
+// A free range at the end of a pool at least this large is given back to
+// the kernel. Blocks are reused first fit, so the end is reused last.
+#define POOL_TRIM_SIZE ((size_t)32 * 1024 * 1024)
+
+#define ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct shm_block {
+	size_t offset, size;
+	bool used;
+	struct wl_list link; // shm_pool::blocks, ordered by offset
+};
+
+struct shm_pool {
+	struct wl_shm_pool *pool;
+	int fd;
+	char *data;
+	size_t size; // mapped and shared with the compositor
+	size_t reserved;
+	struct wl_list blocks;
+	struct wl_list link;
+};
+
+struct shm_allocator {
+	struct wl_shm *shm;
+	size_t page_size;
+	struct wl_list pools;
+	// Effects and background renders allocate on worker threads, and
+	// screenshot workers free buffers
+	pthread_mutex_t lock;
+};
+
+static int anonymous_shm_open(void) {
+	int retries = 100;
+
+	do {
+		// try a probably-unique name
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		pid_t pid = getpid();
+		char name[50];
+		snprintf(name, sizeof(name), "/swaylock-%x-%x",
+			(unsigned int)pid, (unsigned int)ts.tv_nsec);
+
+		// shm_open guarantees that O_CLOEXEC is set
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+			return fd;
+		}
+
+		--retries;
+	} while (retries > 0 && errno == EEXIST);
+
+	return -1;
+}
+
+static int create_pool_fd(void) {
+#ifdef MFD_ALLOW_SEALING
+	int fd = memfd_create("swaylock", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		// Pools only ever grow; the seal lets the compositor rely on that
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+		return fd;
+	}
+	if (errno != ENOSYS) {
+		swaylock_log_errno(LOG_ERROR, "memfd_create failed");
+		return -1;
+	}
+#endif
+	return anonymous_shm_open();
+}
+
+// Faults in the pages of a range up front, so the first paint into a buffer
+// doesn't take a page fault for every 4 KiB of it.
+static void prefault(void *data, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+	madvise(data, size, MADV_POPULATE_WRITE);
+#endif
+}
+
+static bool grow_pool(struct shm_allocator *alloc, struct shm_pool *pool,
+		size_t size) {
+	if (ftruncate(pool->fd, size) < 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to grow shm pool to %zu bytes", size);
+		return false;
+	}
+
+	int flags = MAP_SHARED | MAP_FIXED;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	void *data = mmap(pool->data + pool->size, size - pool->size,
+			PROT_READ | PROT_WRITE, flags, pool->fd, pool->size);
+	if (data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to map shm pool");
+		return false;
+	}
+#if defined(USE_HUGEPAGES) && defined(MADV_HUGEPAGE)
+	madvise(data, size - pool->size, MADV_HUGEPAGE);
+#endif
+
+	if (pool->pool == NULL) {
+		pool->pool = wl_shm_create_pool(alloc->shm, pool->fd, size);
+	} else {
+		wl_shm_pool_resize(pool->pool, size);
+	}
+
+	// Extend the free block at the end, or add one
+	struct shm_block *last = wl_list_empty(&pool->blocks) ? NULL :
+		wl_container_of(pool->blocks.prev, last, link);
+	if (last && !last->used) {
+		last->size = size - last->offset;
+	} else {
+		struct shm_block *block = calloc(1, sizeof(*block));
+		block->offset = pool->size;
+		block->size = size - pool->size;
+		wl_list_insert(pool->blocks.prev, &block->link);
+	}
+	pool->size = size;
+	return true;
+}
+
+static struct shm_pool *create_pool(struct shm_allocator *alloc, size_t reserve) {
+	struct shm_pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->fd = create_pool_fd();
+	if (pool->fd < 0) {
+		free(pool);
+		return NULL;
+	}
+
+	// Hugepages need the mapping to be aligned like the file offsets
+	void *data = mmap(NULL, reserve + HUGEPAGE_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to reserve shm pool");
+		close(pool->fd);
+		free(pool);
+		return NULL;
+	}
+	uintptr_t start = (uintptr_t)data, end = start + reserve + HUGEPAGE_SIZE;
+	uintptr_t aligned = ALIGN(start, HUGEPAGE_SIZE);
+	if (aligned > start) {
+		munmap(data, aligned - start);
+	}
+	if (end > aligned + reserve) {
+		munmap((char *)aligned + reserve, end - aligned - reserve);
+	}
+
+	pool->data = (char *)aligned;
+	pool->reserved = reserve;
+	wl_list_init(&pool->blocks);
+	wl_list_insert(alloc->pools.prev, &pool->link);
+	return pool;
+}
+
+// Takes size bytes out of a free block, splitting off what's left over
+// on either side of the aligned start.
+static struct shm_block *take_block(struct shm_block *block, size_t size,
+		size_t align) {
+	size_t start = ALIGN(block->offset, align);
+	if (block->used || start + size > block->offset + block->size) {
+		return NULL;
+	}
+
+	if (start > block->offset) {
+		struct shm_block *before = calloc(1, sizeof(*before));
+		before->offset = block->offset;
+		before->size = start - block->offset;
+		wl_list_insert(block->link.prev, &before->link);
+		block->offset = start;
+		block->size -= before->size;
+	}
+	if (block->size > size) {
+		struct shm_block *after = calloc(1, sizeof(*after));
+		after->offset = block->offset + size;
+		after->size = block->size - size;
+		wl_list_insert(&block->link, &after->link);
+		block->size = size;
+	}
+	block->used = true;
+	return block;
+}
+
+static struct shm_block *allocate_block(struct shm_allocator *alloc,
+		size_t size, size_t align, struct shm_pool **pool_out) {
+	struct shm_pool *pool;
+	struct shm_block *block;
+	wl_list_for_each(pool, &alloc->pools, link) {
+		wl_list_for_each(block, &pool->blocks, link) {
+			if (take_block(block, size, align)) {
+				*pool_out = pool;
+				return block;
+			}
+		}
+	}
+
+	// Nothing free is large enough; grow a pool which has room left,
+	// reusing the free space at its end
+	wl_list_for_each(pool, &alloc->pools, link) {
+		size_t end = pool->size;
+		if (!wl_list_empty(&pool->blocks)) {
+			struct shm_block *last =
+				wl_container_of(pool->blocks.prev, last, link);
+			if (!last->used) {
+				end = last->offset;
+			}
+		}
+		size_t new_size = ALIGN(end, align) + size;
+		if (new_size <= pool->reserved && new_size <= INT32_MAX) {
+			if (!grow_pool(alloc, pool, new_size)) {
+				return NULL;
+			}
+			block = wl_container_of(pool->blocks.prev, block, link);
+			*pool_out = pool;
+			return take_block(block, size, align);
+		}
+	}
+
+	if (size > INT32_MAX) {
+		swaylock_log(LOG_ERROR, "Can't allocate a %zu byte shm buffer", size);
+		return NULL;
+	}
+	pool = create_pool(alloc, size > POOL_RESERVE ? size : POOL_RESERVE);
+	if (pool == NULL || !grow_pool(alloc, pool, size)) {
+		return NULL;
+	}
+	block = wl_container_of(pool->blocks.next, block, link);
+	*pool_out = pool;
+	return take_block(block, size, align);
+}
+
+struct shm_allocator *shm_allocator_create(struct wl_shm *shm) {
+	struct shm_allocator *alloc = calloc(1, sizeof(*alloc));
+	if (alloc == NULL) {
+		return NULL;
+	}
+	alloc->shm = shm;
+	alloc->page_size = sysconf(_SC_PAGESIZE);
+	wl_list_init(&alloc->pools);
+	pthread_mutex_init(&alloc->lock, NULL);
+	return alloc;
+}
+
+static size_t buffer_alignment(struct shm_allocator *alloc, size_t size) {
+#ifdef USE_HUGEPAGES
+	if (size >= HUGEPAGE_SIZE) {
+		return HUGEPAGE_SIZE;
+	}
+#endif
+	return alloc->page_size;
+}
+
+struct wl_buffer *shm_create_buffer(struct shm_allocator *alloc,
+		int32_t width, int32_t height, int32_t stride, uint32_t format,
+		void **data) {
+	size_t size = ALIGN((size_t)stride * height, alloc->page_size);
+
+	pthread_mutex_lock(&alloc->lock);
+	struct shm_pool *pool;
+	struct shm_block *block = allocate_block(alloc, size,
+			buffer_alignment(alloc, size), &pool);
+	struct wl_buffer *buffer = NULL;
+	if (block) {
+		buffer = wl_shm_pool_create_buffer(pool->pool, block->offset,
+				width, height, stride, format);
+		*data = pool->data + block->offset;
+	}
+	pthread_mutex_unlock(&alloc->lock);
+
+	if (buffer) {
+		prefault(*data, size);
+	}
+	return buffer;
+}
+
+struct shm_image {
+	struct shm_allocator *alloc;
+	void *data;
+	struct wl_buffer *buffer;
+};
+
+static const cairo_user_data_key_t shm_image_key;
+
+static void shm_image_destroy(void *data) {
+	struct shm_image *image = data;
+	if (image->buffer) {
+		wl_buffer_destroy(image->buffer);
+	}
+	shm_free(image->alloc, image->data);
+	free(image);
+}
+
+cairo_surface_t *shm_image_wrap(struct shm_allocator *alloc, void *data,
+		cairo_format_t format, int width, int height, int stride) {
+	struct shm_image *image = calloc(1, sizeof(*image));
+	if (image == NULL) {
+		return NULL;
+	}
+	image->alloc = alloc;
+	image->data = data;
+
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+			data, format, width, height, stride);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+			cairo_surface_set_user_data(surface, &shm_image_key,
+				image, shm_image_destroy) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		free(image);
+		return NULL;
+	}
+	return surface;
+}
+
+cairo_surface_t *shm_image_create(struct shm_allocator *alloc,
+		cairo_format_t format, int width, int height) {
+	int stride = cairo_format_stride_for_width(format, width);
+	if (stride < 0 || width <= 0 || height <= 0) {
+		return NULL;
+	}
+	size_t size = ALIGN((size_t)stride * height, alloc->page_size);
+
+	pthread_mutex_lock(&alloc->lock);
+	struct shm_pool *pool;
+	struct shm_block *block = allocate_block(alloc, size,
+			buffer_alignment(alloc, size), &pool);
+	void *data = block ? pool->data + block->offset : NULL;
+	pthread_mutex_unlock(&alloc->lock);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	prefault(data, size);
+	cairo_surface_t *surface = shm_image_wrap(alloc, data, format,
+			width, height, stride);
+	if (surface == NULL) {
+		shm_free(alloc, data);
+	}
+	return surface;
+}
+
+struct wl_buffer *shm_image_get_buffer(cairo_surface_t *surface) {
+	struct shm_image *image =
+		cairo_surface_get_user_data(surface, &shm_image_key);
+	if (image == NULL) {
+		return NULL;
+	}
+
+	uint32_t format;
+	switch (cairo_image_surface_get_format(surface)) {
+	case CAIRO_FORMAT_RGB24:
+		format = WL_SHM_FORMAT_XRGB8888;
+		break;
+	case CAIRO_FORMAT_ARGB32:
+		format = WL_SHM_FORMAT_ARGB8888;
+		break;
+	default:
+		return NULL;
+	}
+
+	// Outputs showing the same image may be rendered at the same time
+	struct shm_allocator *alloc = image->alloc;
+	pthread_mutex_lock(&alloc->lock);
+	struct shm_pool *pool;
+	wl_list_for_each(pool, &alloc->pools, link) {
+		if (image->buffer == NULL && (char *)image->data >= pool->data &&
+				(char *)image->data < pool->data + pool->size) {
+			image->buffer = wl_shm_pool_create_buffer(pool->pool,
+					(char *)image->data - pool->data,
+					cairo_image_surface_get_width(surface),
+					cairo_image_surface_get_height(surface),
+					cairo_image_surface_get_stride(surface), format);
+		}
+	}
+	struct wl_buffer *buffer = image->buffer;
+	pthread_mutex_unlock(&alloc->lock);
+	return buffer;
+}
+
+void shm_free(struct shm_allocator *alloc, void *data) {
+	pthread_mutex_lock(&alloc->lock);
+	struct shm_pool *pool;
+	wl_list_for_each(pool, &alloc->pools, link) {
+		if ((char *)data < pool->data || (char *)data >= pool->data + pool->size) {
+			continue;
+		}
+
+		size_t offset = (char *)data - pool->data;
+		struct shm_block *block;
+		wl_list_for_each(block, &pool->blocks, link) {
+			if (block->offset != offset || !block->used) {
+				continue;
+			}
+
+			// The pages stay populated, so that the next buffer which
+			// reuses them doesn't fault them in again
+			block->used = false;
+
+			struct shm_block *next = wl_container_of(block->link.next, next, link);
+			if (&next->link != &pool->blocks && !next->used) {
+				block->size += next->size;
+				wl_list_remove(&next->link);
+				free(next);
+			}
+			struct shm_block *prev = wl_container_of(block->link.prev, prev, link);
+			if (&prev->link != &pool->blocks && !prev->used) {
+				prev->size += block->size;
+				wl_list_remove(&block->link);
+				free(block);
+				block = prev;
+			}
+
+			// Give a large free tail back; the range stays in the pool
+			// for reuse
+#ifdef FALLOC_FL_PUNCH_HOLE
+			if (block->link.next == &pool->blocks &&
+					block->size >= POOL_TRIM_SIZE) {
+				fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+						block->offset, block->size);
+			}
+#endif
+			break;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&alloc->lock);
+}